@@ -35,6 +35,20 @@ typedef struct {
 } MemoryInfo;
 MemoryInfo g_memoryInfo;
 
+// must match kernel/include/paging.h, the kernel leaves the lower half to processes
+#define DIRECT_MAP_BASE 0xFFFF800000000000
+#define KERNEL_VMA 0xFFFFFFFF80000000
+#define PHYS_TO_VIRT(address) ((void *)((UINT64)(address) + DIRECT_MAP_BASE))
+
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_WRITABLE (1 << 1)
+#define PAGE_HUGE (1 << 7)
+#define PAGE_ADDR_MASK 0x000ffffffffff000
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+#define PML4_INDEX(address) (((UINT64)(address) >> 39) & 0x1FF)
+#define PDPT_INDEX(address) (((UINT64)(address) >> 30) & 0x1FF)
+
 typedef struct {
     Framebuffer *framebuffer;
     PSF1_FONT *font;
@@ -49,6 +63,7 @@ int memcmp(const void *, const void *, size_t);
 Framebuffer* InitializeGop();
 MemoryInfo* GetMemoryInfo(EFI_SYSTEM_TABLE *);
 void* GetRootSystemDescriptor(EFI_SYSTEM_TABLE *);
+UINT64* BuildPageTables(EFI_SYSTEM_TABLE *, Framebuffer *);
 UINTN strcmp(CHAR8 *, CHAR8 *, UINTN);
 
 EFI_STATUS efi_main (EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable) {
@@ -87,15 +102,34 @@ EFI_STATUS efi_main (EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable) {
         kernel->Read(kernel, &headerTableSize, pHeaders);
     }
 
+    // the image is allocated as one block, the gaps the kernel leaves between sections to align them
+    // for huge pages are mapped along with the sections and must not be handed to anything else
+    Elf64_Addr imageStart = ~0ULL;
+    Elf64_Addr imageEnd = 0;
+    for (Elf64_Phdr *pHeader = pHeaders; (char *)pHeader < (char *)pHeaders + headerTableSize; pHeader = (Elf64_Phdr *)((char *)pHeader + header.e_phentsize))
+    {
+        if (pHeader->p_type != PT_LOAD) continue;
+        if (pHeader->p_paddr < imageStart) imageStart = pHeader->p_paddr;
+        if (pHeader->p_paddr + pHeader->p_memsz > imageEnd) imageEnd = pHeader->p_paddr + pHeader->p_memsz;
+    }
+    {
+        imageStart &= ~0xFFFULL;
+        UINTN pages = (imageEnd - imageStart + 0x1000 - 1) / 0x1000;
+        if (systemTable->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &imageStart) != EFI_SUCCESS)
+        {
+            Print(L"ERROR: Unable to allocate memory for the kernel.\n\r");
+            return EFI_LOAD_ERROR;
+        }
+        ZeroMem((void *)imageStart, pages * 0x1000);
+    }
+
     for (Elf64_Phdr *pHeader = pHeaders; (char *)pHeader < (char *)pHeaders + headerTableSize; pHeader = (Elf64_Phdr *)((char *)pHeader + header.e_phentsize))
     {
         switch (pHeader->p_type)
         {
             case PT_LOAD:
             {
-                uint64_t pages = (pHeader->p_memsz + 0x1000 - 1) / 0x1000;
                 Elf64_Addr segment = pHeader->p_paddr;
-                systemTable->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &segment);
                 kernel->SetPosition(kernel, pHeader->p_offset);
                 UINTN size = pHeader->p_filesz;
                 kernel->Read(kernel, &size, (void *)segment);
@@ -117,6 +151,13 @@ EFI_STATUS efi_main (EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable) {
 
     Framebuffer *framebuffer = InitializeGop();
 
+    UINT64 *pml4 = BuildPageTables(systemTable, framebuffer);
+    if (pml4 == NULL)
+    {
+        Print(L"ERROR: Unable to allocate page tables.\n\r");
+        return EFI_LOAD_ERROR;
+    }
+
     MemoryInfo *memoryInfo = GetMemoryInfo(systemTable);
     void *rsdp = GetRootSystemDescriptor(systemTable);
 
@@ -133,8 +174,20 @@ EFI_STATUS efi_main (EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE *systemTable) {
                                                        memoryInfo->memoryMapDescriptorVersion,
                                                        memoryInfo->memoryMap);
 
+    // the kernel only uses the direct map, every pointer it is handed is moved in to it
+    framebuffer->BaseAddress = PHYS_TO_VIRT(framebuffer->BaseAddress);
+    font->header = PHYS_TO_VIRT(font->header);
+    font->glyphBuffer = PHYS_TO_VIRT(font->glyphBuffer);
+    memoryInfo->memoryMap = PHYS_TO_VIRT(memoryInfo->memoryMap);
+    bootInfo.framebuffer = PHYS_TO_VIRT(framebuffer);
+    bootInfo.font = PHYS_TO_VIRT(font);
+    bootInfo.memoryInfo = PHYS_TO_VIRT(memoryInfo);
+    bootInfo.rootSystemDescriptionPointer = PHYS_TO_VIRT(rsdp);
+
+    asm volatile ("mov %0, %%cr3" : : "r"(pml4) : "memory");
+
     void (*KernelStart)(BootInfo*) = (__attribute__((sysv_abi)) void (*)(BootInfo*) ) header.e_entry;
-    KernelStart(&bootInfo);
+    KernelStart(PHYS_TO_VIRT(&bootInfo));
 
 	return EFI_SUCCESS; // Exit the UEFI application
 }
@@ -290,4 +343,61 @@ UINTN strcmp(CHAR8 *a, CHAR8 *b, UINTN length)
         if (*a != *b) return 0;
     }
     return 1;
-}
\ No newline at end of file
+}
+
+// tables for the jump in to the kernel: the firmware's lower half, which the loader keeps running from,
+// all of physical memory at DIRECT_MAP_BASE and the first GiB again at KERNEL_VMA for the image. 2 MiB
+// pages throughout, the kernel builds its own tables as soon as it has a frame allocator
+UINT64* BuildPageTables(EFI_SYSTEM_TABLE *systemTable, Framebuffer *framebuffer)
+{
+    UINT64 end = 0;
+    if (framebuffer != NULL) end = (UINT64)framebuffer->BaseAddress + framebuffer->BufferSize;
+
+    MemoryInfo *memoryInfo = GetMemoryInfo(systemTable);
+    UINTN entries = memoryInfo->memoryMapSize / memoryInfo->memoryMapDescriptorSize;
+    for (UINTN i = 0; i < entries; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)memoryInfo->memoryMap + (i * memoryInfo->memoryMapDescriptorSize));
+        if (desc->Type == EfiMemoryMappedIO || desc->Type == EfiMemoryMappedIOPortSpace) continue;
+
+        UINT64 descEnd = desc->PhysicalStart + (desc->NumberOfPages * 0x1000);
+        if (descEnd > end) end = descEnd;
+    }
+    systemTable->BootServices->FreePool(memoryInfo->memoryMap);
+
+    UINTN gigabytes = (end + PAGE_SIZE_1G - 1) / PAGE_SIZE_1G;
+    if (gigabytes > 512) gigabytes = 512; // what one PDPT covers
+
+    // pml4, a pdpt and a pd for the image, a pdpt and a pd per GiB for the direct map
+    EFI_PHYSICAL_ADDRESS tables;
+    UINTN pages = 4 + gigabytes;
+    if (systemTable->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &tables) != EFI_SUCCESS) return NULL;
+    ZeroMem((void *)tables, pages * 0x1000);
+
+    UINT64 *pml4 = (UINT64 *)tables;
+    UINT64 *kernelPdpt = pml4 + 512;
+    UINT64 *kernelPd = kernelPdpt + 512;
+    UINT64 *directPdpt = kernelPd + 512;
+    UINT64 *directPds = directPdpt + 512;
+
+    UINT64 firmwarePml4;
+    asm volatile ("mov %%cr3, %0" : "=r"(firmwarePml4));
+    for (UINTN i = 0; i < 256; i++) {
+        pml4[i] = ((UINT64 *)(firmwarePml4 & PAGE_ADDR_MASK))[i];
+    }
+
+    for (UINTN i = 0; i < gigabytes * 512; i++) {
+        directPds[i] = (i * PAGE_SIZE_2M) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE;
+    }
+    for (UINTN i = 0; i < gigabytes; i++) {
+        directPdpt[i] = (UINT64)(directPds + (i * 512)) | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    pml4[PML4_INDEX(DIRECT_MAP_BASE)] = (UINT64)directPdpt | PAGE_PRESENT | PAGE_WRITABLE;
+
+    for (UINTN i = 0; i < 512; i++) {
+        kernelPd[i] = (i * PAGE_SIZE_2M) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE;
+    }
+    kernelPdpt[PDPT_INDEX(KERNEL_VMA)] = (UINT64)kernelPd | PAGE_PRESENT | PAGE_WRITABLE;
+    pml4[PML4_INDEX(KERNEL_VMA)] = (UINT64)kernelPdpt | PAGE_PRESENT | PAGE_WRITABLE;
+
+    return pml4;
+}
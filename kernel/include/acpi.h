@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 typedef struct {
     char signature[8];              // 8-byte (not null terminated) string: "RSD PTR "
@@ -39,4 +41,5 @@ typedef struct {
     uint32_t reserved;              // reserved
 } __attribute__((packed)) acpi_mcfg_device_t;
 
-void * acpi_find_table(acpi_sdt_header_t *header, char *signature);
\ No newline at end of file
+void * acpi_find_table(acpi_sdt_header_t *header, char *signature);
+bool acpi_copy_tables(rsdp_descriptor_t *rsdp, const char **signatures, size_t count);
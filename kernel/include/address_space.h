@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pagetable_manager.h"
+
+#define PCID_COUNT 4096
+#define PCID_KERNEL 0           // the boot address space built by pagetable_init
+
+typedef struct {
+    pml4_t *pml4;
+    uint16_t pcid;              // PCID_KERNEL for every space when PCIDs are unsupported
+} address_space_t;
+
+void address_space_cpu_init(void);
+bool address_space_init(address_space_t *space, pml4_t *pml4);
+void address_space_release(address_space_t *space);
+void address_space_switch(address_space_t *space);
+bool address_space_pcid_enabled(void);
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #include "pci.h"
+#include "spinlock.h"
 
 typedef enum {
     AHCI_DEVICE_TYPE_NULL = 0,
@@ -321,7 +322,16 @@ typedef struct {
     AHCI_DEVICE_TYPE type;
     uint8_t *buffer;
     uint8_t portnum;
+    uint8_t command_slots;
+    bool dma64;             // the HBA can reach buffers above 4 GiB
+    spinlock_t lock;        // slot choice, issue and error recovery
+    uint32_t failed;        // slots whose command a task file error ended, until ahci_wait reports it
 } ahci_port_t;
 
 void ahci_init(ahci_driver_t *driver, pci_device_hdr_t *pci_base_address);
+int ahci_issue(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer, bool write);
+bool ahci_wait(ahci_port_t *port, int slot);
 bool ahci_read(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer);
+bool ahci_write(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer);
+uint8_t ahci_port_count(void);
+ahci_port_t* ahci_port(uint8_t index);
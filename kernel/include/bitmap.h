@@ -5,12 +5,21 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#define BITMAP_NONE ((uint64_t)-1)
+
 typedef struct {
-    size_t size;
-    uint8_t *buffer;
+    size_t size;            // bytes of bit storage, rounded up to whole 64-bit words
+    uint64_t *buffer;
+    uint64_t *summary;      // one bit per buffer word, set while every bit in that word is set
 } bitmap_t;
 
+size_t bitmap_buffer_size(size_t size);
 void bitmap_init(bitmap_t *bitmap, size_t size, void *buffer);
 bool bitmap_check(bitmap_t *bitmap, uint64_t index);
 bool bitmap_set(bitmap_t *bitmap, uint64_t index);
-bool bitmap_clear(bitmap_t *bitmap, uint64_t index);
\ No newline at end of file
+bool bitmap_clear(bitmap_t *bitmap, uint64_t index);
+uint64_t bitmap_find_first_zero(bitmap_t *bitmap, uint64_t start);
+uint64_t bitmap_find_first_set(bitmap_t *bitmap, uint64_t start);
+uint64_t bitmap_find_zero_run(bitmap_t *bitmap, uint64_t start, uint64_t count);
+uint64_t bitmap_set_range(bitmap_t *bitmap, uint64_t start, uint64_t count);
+uint64_t bitmap_clear_range(bitmap_t *bitmap, uint64_t start, uint64_t count);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+#include "bitmap.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BUDDY_MAX_ORDER 10                  // largest block is 2^10 frames (4 MiB)
+#define BUDDY_NONE      ((uint64_t)-1)
+
+typedef struct buddy_block_t buddy_block_t;
+struct buddy_block_t {
+    buddy_block_t *next;
+    buddy_block_t *prev;
+};
+
+typedef struct {
+    uint64_t base;                                  // first frame number, aligned to the largest block size
+    uint64_t frames;                                // number of frames covered from base
+    uint64_t free;                                  // number of frames held in the free lists
+    buddy_block_t *free_lists[BUDDY_MAX_ORDER + 1];
+    bitmap_t free_maps[BUDDY_MAX_ORDER + 1];        // one bit per block, set while the block is on its free list
+} buddy_t;
+
+size_t buddy_metadata_size(uint64_t base, uint64_t frames);
+void buddy_init(buddy_t *buddy, uint64_t base, uint64_t frames, void *buffer);
+uint64_t buddy_alloc(buddy_t *buddy, unsigned int order);
+void buddy_free(buddy_t *buddy, uint64_t frame, unsigned int order);
+void buddy_free_range(buddy_t *buddy, uint64_t frame, uint64_t count);
+bool buddy_reserve(buddy_t *buddy, uint64_t frame);
@@ -2,9 +2,130 @@
 
 #include <stdint.h>
 
-static inline void cpuid(int code, uint32_t *a, uint32_t *d);
-static inline uint64_t rdtsc(void);
-static inline unsigned long read_cr0(void);
-static inline void invlpg(void * m);
-static inline void wrmsr(uint64_t msr, uint64_t value);
-static inline uint64_t rdmsr(uint32_t msr);
\ No newline at end of file
+#define MSR_PAT             0x277
+#define MSR_EFER            0xC0000080
+#define MSR_GS_BASE         0xC0000101
+
+#define EFER_NXE            (1 << 11)      // no-execute bit in page table entries
+
+#define CR0_WP              (1 << 16)      // read-only pages apply to the kernel too
+#define CR3_PCID_MASK       0xFFF
+#define CR3_NOFLUSH         (1ULL << 63)   // keep the TLB entries tagged with the new PCID
+#define CR4_PGE             (1 << 7)
+#define CR4_PCIDE           (1 << 17)
+
+#define CPUID_FEATURES      1
+#define CPUID_EDX_PGE       (1 << 13)      // global pages
+#define CPUID_EDX_PAT       (1 << 16)      // page attribute table
+#define CPUID_ECX_PCID      (1 << 17)      // process-context identifiers
+#define CPUID_EXT_MAX       0x80000000
+#define CPUID_EXT_FEATURES  0x80000001
+#define CPUID_EDX_NX        (1 << 20)      // no-execute pages
+#define CPUID_EDX_PDPE1GB   (1 << 26)      // 1 GiB pages
+
+// Request for CPU identification
+static inline void cpuid(int code, uint32_t *a, uint32_t *d)
+{
+    asm volatile ( "cpuid" : "=a"(*a), "=d"(*d) : "0"(code) : "ebx", "ecx" );
+}
+
+// Request for CPU identification, returning all four registers
+static inline void cpuid_regs(uint32_t code, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    asm volatile ( "cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "0"(code), "2"(0) );
+}
+
+// Read the current value of the CPU's time-stamp counter and store into EDX:EAX
+static inline uint64_t rdtsc(void)
+{
+    uint32_t low, high;
+    asm volatile ( "rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Read the value in CR0
+static inline unsigned long read_cr0(void)
+{
+    unsigned long ret;
+    asm volatile ( "mov {%%cr0, %0 | %0, cr0}" : "=r"(ret) );
+    return ret;
+}
+
+// Write CR0
+static inline void write_cr0(unsigned long value)
+{
+    asm volatile ( "mov {%0, %%cr0 | cr0, %0}" : : "r"(value) : "memory" );
+}
+
+// Read the value in CR2, the address that caused the last page fault
+static inline unsigned long read_cr2(void)
+{
+    unsigned long ret;
+    asm volatile ( "mov {%%cr2, %0 | %0, cr2}" : "=r"(ret) );
+    return ret;
+}
+
+// Read the value in CR3
+static inline unsigned long read_cr3(void)
+{
+    unsigned long ret;
+    asm volatile ( "mov {%%cr3, %0 | %0, cr3}" : "=r"(ret) );
+    return ret;
+}
+
+// Write CR3, flushing all non-global TLB entries
+static inline void write_cr3(unsigned long value)
+{
+    asm volatile ( "mov {%0, %%cr3 | cr3, %0}" : : "r"(value) : "memory" );
+}
+
+// Read the value in CR4
+static inline unsigned long read_cr4(void)
+{
+    unsigned long ret;
+    asm volatile ( "mov {%%cr4, %0 | %0, cr4}" : "=r"(ret) );
+    return ret;
+}
+
+// Write CR4
+static inline void write_cr4(unsigned long value)
+{
+    asm volatile ( "mov {%0, %%cr4 | cr4, %0}" : : "r"(value) : "memory" );
+}
+
+// Invalidates the TLB for one specific virtual address
+static inline void invlpg(void * m)
+{
+    /* Clobber memory to avoid optimizer re-ordering access before invlpg, which may cause nasty bugs. */
+    asm volatile ( "invlpg {(%0) | [%0]}" : : "b"(m) : "memory" );
+}
+
+// Write a 64-bit value to a MSR.
+static inline void wrmsr(uint64_t msr, uint64_t value)
+{
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    asm volatile ( "wrmsr" : : "c"(msr), "a"(low), "d"(high) );
+}
+
+// Read a 64-bit value from a MSR
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low, high;
+    asm volatile ( "rdmsr" : "=a"(low), "=d"(high) : "c"(msr) );
+    return ((uint64_t)high << 32) | low;
+}
+
+// Save RFLAGS and disable interrupts, returning the saved flags
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    asm volatile ( "pushfq\n\tpop %0\n\tcli" : "=r"(flags) : : "memory" );
+    return flags;
+}
+
+// Restore RFLAGS saved by irq_save, re-enabling interrupts if they were enabled
+static inline void irq_restore(uint64_t flags)
+{
+    asm volatile ( "push %0\n\tpopfq" : : "r"(flags) : "memory", "cc" );
+}
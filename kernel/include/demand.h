@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define DEMAND_MAX_REGIONS 16
+
+// page fault error code bits
+#define PF_PRESENT  (1 << 0)    // the page was present, a protection violation rather than a missing page
+#define PF_WRITE    (1 << 1)
+#define PF_USER     (1 << 2)
+#define PF_RESERVED (1 << 3)
+#define PF_FETCH    (1 << 4)
+
+// a software bit in present entries, the page is shared read-only and copied on the first write to it
+#define PAGE_BIT_COW (1 << 10)
+
+bool demand_reserve(void *address, size_t pages, uint64_t flags, bool evictable);
+bool demand_release(void *address);
+bool demand_fault(void *address, uint64_t error);
+void demand_unmap(void *address, size_t pages);
+bool demand_share(void *dest, void *src, size_t pages);
+uint64_t demand_evict(uint64_t frames);
+uint64_t demand_faults(void);
+uint64_t demand_swap_ins(void);
+uint64_t demand_cow_copies(void);
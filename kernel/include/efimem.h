@@ -22,4 +22,10 @@ typedef struct {
 
 extern const char *EFI_MEMORY_TYPE_STRINGS[];
 
-#define EFI_CONVENTIONAL_MEMORY_TYPE_INDEX 7
\ No newline at end of file
+#define EFI_LOADER_DATA_TYPE_INDEX 2
+#define EFI_BOOT_SERVICES_CODE_TYPE_INDEX 3
+#define EFI_BOOT_SERVICES_DATA_TYPE_INDEX 4
+#define EFI_CONVENTIONAL_MEMORY_TYPE_INDEX 7
+#define EFI_ACPI_RECLAIM_MEMORY_TYPE_INDEX 9
+#define EFI_MMIO_TYPE_INDEX 11
+#define EFI_MMIO_PORT_SPACE_TYPE_INDEX 12
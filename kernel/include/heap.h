@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 typedef struct heap_hdr_t heap_hdr_t;
@@ -11,7 +12,11 @@ struct heap_hdr_t {
     bool free;
 };
 
+#define HEAP_WINDOW_SIZE 0x100000000000     // 16 TiB of address space, half for segments and half for direct allocations
+
 void heap_init(void *address, size_t pages);
 void* heap_alloc(size_t size);
 void* heap_calloc(size_t size);
+void* heap_realloc(void *ptr, size_t size);
 void heap_free(void *address);
+uint64_t heap_alloc_worst_cycles(void);
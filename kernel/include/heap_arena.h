@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+
+#define HEAP_ARENA_LIMIT 0x200      // larger requests go to the central heap
+
+void* heap_arena_alloc(size_t size);
+void heap_arena_free(void *address);
+size_t heap_arena_size(void *address);
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <stdint.h>
+
 struct interrupt_frame;
 
-__attribute__((interrupt)) void int_handler_pagefault(struct interrupt_frame *frame);
+__attribute__((interrupt)) void int_handler_pagefault(struct interrupt_frame *frame, uint64_t error_code);
 __attribute__((interrupt)) void int_handler_double_fault(struct interrupt_frame *frame);
 __attribute__((interrupt)) void int_handler_general_protection(struct interrupt_frame *frame);
 __attribute__((interrupt)) void int_handler_keyboard(struct interrupt_frame *frame);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "memory.h"
+
+#define MEMBLOCK_MAX_RANGES 128
+
+// a physical range, page aligned
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} memblock_range_t;
+
+void memblock_init(memory_info_t *memory_info);
+bool memblock_reserve(uint64_t base, uint64_t size);
+void* memblock_alloc(size_t size);
+bool memblock_active(void);
+size_t memblock_reserved(const memblock_range_t **ranges);
+void memblock_retire(void);
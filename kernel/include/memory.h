@@ -3,4 +3,4 @@
 #include "types.h"
 #include "efimem.h"
 
-uint64_t system_memory_size(memory_info_t *memory_info);
+uint64_t system_memory_end(memory_info_t *memory_info);
@@ -7,6 +7,33 @@
 #include "types.h"
 #include "memory.h"
 #include "bitmap.h"
+#include "buddy.h"
+
+typedef enum {
+    ZONE_DMA32 = 0,     // below 4 GiB, reachable by 32-bit DMA
+    ZONE_NORMAL = 1
+} PAGEFRAME_ZONE;
+
+#define PAGEFRAME_ZONE_COUNT 2
+
+typedef uint64_t (*pageframe_reclaim_t)(uint64_t frames);
+
+typedef enum {
+    PAGEFRAME_OWNER_NONE = 0,
+    PAGEFRAME_OWNER_PAGETABLE = 1,
+    PAGEFRAME_OWNER_DEMAND = 2,
+    PAGEFRAME_OWNER_SLAB = 3,
+    PAGEFRAME_OWNER_HEAP_ARENA = 4
+} PAGEFRAME_OWNER;
+
+#define PAGEFRAME_FLAG_PINNED (1 << 0)      // never freed, like the shared zero page mapped all over
+
+// the page database entry for a frame
+typedef struct {
+    uint32_t refcount;                      // references beyond the first, pageframe_free drops one of these before the frame
+    uint16_t flags;
+    uint16_t owner;                         // PAGEFRAME_OWNER of whoever allocated it, for debugging
+} pageframe_desc_t;
 
 void pageframe_allocator_init(memory_info_t *memory_info);
 bool pageframe_free(void *address);
@@ -14,6 +41,23 @@ void pageframe_nfree(void *address, size_t page_count);
 bool pageframe_lock(void *address);
 void pageframe_nlock(void *address, size_t page_count);
 void* pageframe_request(void);
+void* pageframe_request_zeroed(void);
+void pageframe_set_reclaim(pageframe_reclaim_t reclaim);
+pageframe_desc_t* pageframe_desc(void *address);
+void pageframe_get(void *address);
+void pageframe_set_owner(void *address, PAGEFRAME_OWNER owner);
+void* pageframe_request_n(unsigned int order);
+void pageframe_free_n(void *address, unsigned int order);
+void* pageframe_request_zone(PAGEFRAME_ZONE zone);
+void* pageframe_request_n_zone(unsigned int order, PAGEFRAME_ZONE zone);
+uint64_t pageframe_zero_idle(void);
+uint64_t pageframe_reclaim(memory_info_t *memory_info, void *keep, bool acpi);
 uint64_t pageframe_memory_free(void);
 uint64_t pageframe_memory_used(void);
 uint64_t pageframe_memory_reserved(void);
+uint64_t pageframe_zone_free(PAGEFRAME_ZONE zone);
+uint64_t pageframe_init_cycles(void);
+uint64_t pageframe_magazine_hits(void);
+uint64_t pageframe_magazine_misses(void);
+uint64_t pageframe_zeroed_hits(void);
+uint64_t pageframe_zeroed_misses(void);
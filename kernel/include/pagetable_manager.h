@@ -2,8 +2,33 @@
 
 #include "boot.h"
 #include "types.h"
+#include "tlb.h"
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PAGE_BIT_P_PRESENT (1<<0)
+#define PAGE_BIT_RW_WRITABLE (1<<1)
+#define PAGE_BIT_US_USER (1<<2)
+#define PAGE_BIT_PWT_WRITE_THROUGH (1<<3)
+#define PAGE_BIT_PCD_CACHE_DISABLE (1<<4)
+#define PAGE_BIT_PS_HUGE (1<<7)
+#define PAGE_BIT_G_GLOBAL (1<<8)
+#define PAGE_XD_NX (1ULL<<63)
+#define PAGE_ADDR_MASK 0x000ffffffffff000
+#define PAGE_BIT_A_ACCESSED (1<<5)
+#define PAGE_BIT_D_DIRTY (1<<6)
+
+#define PAGE_KERNEL_FLAGS (PAGE_BIT_RW_WRITABLE | PAGE_BIT_G_GLOBAL)
+
+// indexes in to the PAT as programmed by pagetable_init, selected with the PWT and PCD bits
+typedef enum {
+    PAGE_CACHE_WB = 0,
+    PAGE_CACHE_WC = 1,
+    PAGE_CACHE_UC_MINUS = 2,
+    PAGE_CACHE_UC = 3
+} PAGE_CACHE_TYPE;
 
 typedef struct mapping_table {
     uint64_t entries[512];
@@ -12,5 +37,13 @@ typedef struct mapping_table {
 typedef struct mapping_table pml4_t;
 
 void pagetable_init(pml4_t *pml4, boot_info_t *boot_info);
-void pagetable_map(pml4_t *pml4, void *logical_address, void *physical_address);
-void pagetable_identity_map(pml4_t *pml4, void *start, size_t page_count);
\ No newline at end of file
+bool pagetable_map(pml4_t *pml4, void *logical_address, void *physical_address);
+bool pagetable_map_range(pml4_t *pml4, void *logical_address, void *physical_address, size_t page_count, uint64_t flags, PAGE_CACHE_TYPE cache);
+bool pagetable_unmap(pml4_t *pml4, void *logical_address, tlb_batch_t *batch);
+bool pagetable_unmap_range(pml4_t *pml4, void *logical_address, size_t page_count, tlb_batch_t *batch);
+void pagetable_free_tables(pml4_t *pml4, void *logical_address, size_t page_count);
+bool pagetable_protect(pml4_t *pml4, void *logical_address, size_t page_count, uint64_t flags, tlb_batch_t *batch);
+void* pagetable_translate(pml4_t *pml4, void *logical_address);
+uint64_t* pagetable_entry(pml4_t *pml4, void *logical_address);
+void pagetable_share_kernel(pml4_t *pml4, pml4_t *kernel);
+bool pagetable_direct_map(pml4_t *pml4, uint64_t physical, size_t page_count, PAGE_CACHE_TYPE cache);
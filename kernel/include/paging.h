@@ -1,5 +1,24 @@
 #pragma once
 
+#include <stdint.h>
+
 #define PAGE_SHIFT      12
 #define PAGE_SIZE       (1UL << PAGE_SHIFT)
 #define PAGE_MASK       (~(PAGE_SIZE-1))
+
+// the lower half is left to per-process mappings, everything of the kernel's lives above this line
+#define KERNEL_SPACE_START  0xFFFF800000000000
+#define DIRECT_MAP_BASE     0xFFFF800000000000  // all of physical memory, mapped with huge pages
+#define KERNEL_VMA          0xFFFFFFFF80000000  // the image is linked here and loaded at the physical address below it
+
+// only for direct map and kernel image addresses, anything else has to go through pagetable_translate
+static inline uint64_t virt_to_phys(const void *address)
+{
+    uint64_t virtual = (uint64_t)address;
+    return virtual >= KERNEL_VMA ? virtual - KERNEL_VMA : virtual - DIRECT_MAP_BASE;
+}
+
+static inline void* phys_to_virt(uint64_t physical)
+{
+    return (void *)(physical + DIRECT_MAP_BASE);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MAX_CPUS 64
+
+typedef struct percpu_t percpu_t;
+struct percpu_t {
+    percpu_t *self;         // must stay first, read through gs:0
+    uint32_t id;
+};
+
+void percpu_init(uint32_t id);
+
+// GS base points at the running CPU's percpu_t once percpu_init has run on it
+static inline percpu_t* this_cpu(void)
+{
+    percpu_t *cpu;
+    asm volatile ( "mov {%%gs:0, %0 | %0, gs:[0]}" : "=r"(cpu) );
+    return cpu;
+}
+
+static inline uint32_t cpu_id(void)
+{
+    return this_cpu()->id;
+}
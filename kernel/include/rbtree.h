@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define rb_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+typedef struct rb_node_t rb_node_t;
+struct rb_node_t {
+    rb_node_t *parent;
+    rb_node_t *left;
+    rb_node_t *right;
+    bool red;
+};
+
+// recomputes whatever a node caches about its subtree from the node and its children
+typedef void (*rb_update_t)(rb_node_t *node);
+
+// intrusive, the caller embeds rb_node_t and does the key comparisons. update may be NULL
+typedef struct {
+    rb_node_t *root;
+    rb_update_t update;
+} rb_tree_t;
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link);
+void rb_erase(rb_tree_t *tree, rb_node_t *node);
+void rb_propagate(rb_tree_t *tree, rb_node_t *node);
+rb_node_t* rb_first(rb_tree_t *tree);
+rb_node_t* rb_next(rb_node_t *node);
+rb_node_t* rb_prev(rb_node_t *node);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// grouped at the start of .text so the paths run on every interrupt and allocation share iTLB entries
+#define HOT_TEXT __attribute__((section(".text.hot")))
+
+// bounds of the image sections from kernel.ld. text, rodata and data each start a 2 MiB block and
+// text and rodata have theirs to themselves, so both can be mapped with huge pages
+extern uint64_t _TextStart;
+extern uint64_t _TextEnd;
+extern uint64_t _RodataStart;
+extern uint64_t _RodataEnd;
+extern uint64_t _DataStart;
+extern uint64_t _DataEnd;
+extern uint64_t _BssStart;
+extern uint64_t _BssEnd;
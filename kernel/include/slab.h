@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+#define KMEM_CACHE_LINE 64          // default object alignment
+#define KMEM_NAME_MAX 32
+
+typedef struct kmem_slab_t kmem_slab_t;
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t active;                // objects currently handed out
+    uint64_t slabs;
+} kmem_cache_stats_t;
+
+typedef struct kmem_cache_t kmem_cache_t;
+struct kmem_cache_t {
+    char name[KMEM_NAME_MAX];
+    size_t size;                    // object stride, a multiple of align
+    size_t align;
+    void (*ctor)(void *);           // run on every object as it is handed out
+    unsigned int order;             // each slab is 2^order frames
+    uint64_t capacity;              // objects per slab
+    size_t offset;                  // first object, past the slab header and its bitmap
+    kmem_slab_t *partial;
+    kmem_slab_t *full;
+    kmem_slab_t *empty;             // one completely free slab is kept back
+    kmem_cache_stats_t stats;
+    spinlock_t lock;
+};
+
+kmem_cache_t* kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+bool kmem_cache_destroy(kmem_cache_t *cache);
+void* kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+void kmem_cache_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ahci.h"
+
+#define SWAP_NONE ((uint64_t)-1)
+#define SWAP_BATCH 8                            // pages written out per round of eviction
+
+// a swapped out page keeps its slot in the otherwise unused bits of its non-present entry
+#define PAGE_BIT_SWAPPED (1 << 9)
+#define SWAP_ENTRY(slot) (((uint64_t)(slot) << 12) | PAGE_BIT_SWAPPED)
+#define SWAP_SLOT(entry) (((entry) & 0x000ffffffffff000) >> 12)
+#define IS_SWAP_ENTRY(entry) (((entry) & (PAGE_BIT_SWAPPED | 1)) == PAGE_BIT_SWAPPED)
+
+bool swap_find(ahci_port_t *port, uint64_t *sector, uint64_t *slots);
+bool swap_init(ahci_port_t *port, uint64_t sector, uint64_t slots);
+bool swap_enabled(void);
+uint64_t swap_alloc(void);
+void swap_free(uint64_t slot);
+int swap_write_begin(unsigned int index, uint64_t slot, void *frame);
+bool swap_write_end(int command);
+bool swap_read(uint64_t slot, void *frame);
+uint64_t swap_slots_used(void);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define TLB_BATCH_MAX 32        // past this many pages one full flush is cheaper than invlpg per page
+
+typedef struct {
+    size_t count;
+    bool full;                  // more addresses were added than fit, the whole TLB is flushed
+    uint64_t addresses[TLB_BATCH_MAX];
+} tlb_batch_t;
+
+void tlb_batch_init(tlb_batch_t *batch);
+void tlb_batch_add(tlb_batch_t *batch, void *address);
+void tlb_batch_flush(tlb_batch_t *batch);
+void tlb_flush_all(void);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "pagetable_manager.h"
+#include "rbtree.h"
+#include "spinlock.h"
+
+#define VMAP_START 0xFFFFC90000000000       // kernel virtual addresses handed out by vmap, 32 TiB of them
+#define VMAP_END 0xFFFFE90000000000         // between the direct map and the kernel image
+#define VMAP_GUARD_PAGES 1                  // left unmapped after every area
+
+// a window of kernel address space handed out a range at a time, free ranges kept in a tree ordered by
+// address that also caches the largest free range under each node
+typedef struct {
+    rb_tree_t free;
+    rb_tree_t busy;
+    size_t busy_count;
+    spinlock_t lock;
+} vmap_space_t;
+
+void vmap_init(void);
+bool vmap_space_init(vmap_space_t *space, void *start, size_t pages);
+void* vmap_space_reserve(vmap_space_t *space, size_t pages);
+void vmap_space_release(vmap_space_t *space, void *address);
+void* vmap_reserve(size_t pages);
+void* vmap(void **frames, size_t count, uint64_t flags, PAGE_CACHE_TYPE cache);
+void* vmalloc(size_t size);
+void* ioremap(uint64_t physical, size_t size, PAGE_CACHE_TYPE cache);
+void vunmap(void *address);
+size_t vmap_area_count(void);
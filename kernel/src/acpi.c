@@ -1,12 +1,22 @@
 #include "acpi.h"
+#include "paging.h"
+#include "pageframe_allocator.h"
+
+#include <string.h>
 
 #define ACPI_STD_HEADER_SIZE_BYTES 8
 
+// private functions
+static void* __copy(void *table, size_t length);
+static void __free(void *copy, size_t length);
+static unsigned int __order(size_t length);
+static void __checksum(void *table, size_t length, uint8_t *checksum);
+
 void * acpi_find_table(acpi_sdt_header_t *header, char *signature)
 {
     int count = (header->length - sizeof(acpi_sdt_header_t)) / 8;
     for (int i = 0; i < count; i++) {
-        acpi_sdt_header_t *hdr =  (acpi_sdt_header_t *)*(uint64_t *)((uint64_t)header + sizeof(acpi_sdt_header_t) + (i * ACPI_STD_HEADER_SIZE_BYTES));
+        acpi_sdt_header_t *hdr =  (acpi_sdt_header_t *)phys_to_virt(*(uint64_t *)((uint64_t)header + sizeof(acpi_sdt_header_t) + (i * ACPI_STD_HEADER_SIZE_BYTES)));
         if (hdr->signature[0] != signature[0]) continue;
         if (hdr->signature[1] != signature[1]) continue;
         if (hdr->signature[2] != signature[2]) continue;
@@ -14,4 +24,69 @@ void * acpi_find_table(acpi_sdt_header_t *header, char *signature)
         return hdr;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+// copies the tables named by signatures out of firmware memory together with an XSDT listing only them,
+// and points rsdp at the new XSDT. false when out of frames, rsdp is then left as it was. tables that
+// are not found are left out
+bool acpi_copy_tables(rsdp_descriptor_t *rsdp, const char **signatures, size_t count)
+{
+    acpi_sdt_header_t *xsdt = (acpi_sdt_header_t *)phys_to_virt(rsdp->xsdt_address);
+    acpi_sdt_header_t *copy = __copy(xsdt, sizeof(acpi_sdt_header_t) + (count * ACPI_STD_HEADER_SIZE_BYTES));
+    if (copy == NULL) return false;
+
+    uint64_t *entries = (uint64_t *)((uint64_t)copy + sizeof(acpi_sdt_header_t));
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        acpi_sdt_header_t *table = acpi_find_table(xsdt, (char *)signatures[i]);
+        if (table == NULL) continue;
+
+        acpi_sdt_header_t *table_copy = __copy(table, table->length);
+        if (table_copy == NULL) {
+            for (size_t j = 0; j < found; j++) {
+                acpi_sdt_header_t *done = (acpi_sdt_header_t *)phys_to_virt(entries[j]);
+                __free(done, done->length);
+            }
+            __free(copy, sizeof(acpi_sdt_header_t) + (count * ACPI_STD_HEADER_SIZE_BYTES));
+            return false;
+        }
+        entries[found++] = virt_to_phys(table_copy);
+    }
+
+    copy->length = sizeof(acpi_sdt_header_t) + (found * ACPI_STD_HEADER_SIZE_BYTES);
+    __checksum(copy, copy->length, &copy->checksum);
+    rsdp->xsdt_address = virt_to_phys(copy);
+    __checksum(rsdp, sizeof(rsdp_descriptor_t), &rsdp->extended_checksum);
+    return true;
+}
+
+// into frames rather than the heap, the copies are handed around by physical address like the originals
+static void* __copy(void *table, size_t length)
+{
+    void *copy = pageframe_request_n(__order(length));
+    if (copy != NULL) memcpy(copy, table, length);
+    return copy;
+}
+
+static void __free(void *copy, size_t length)
+{
+    pageframe_free_n(copy, __order(length));
+}
+
+static unsigned int __order(size_t length)
+{
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < length) order++;
+    return order;
+}
+
+// sets checksum so every byte of the table adds up to zero
+static void __checksum(void *table, size_t length, uint8_t *checksum)
+{
+    uint8_t sum = 0;
+    *checksum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += ((uint8_t *)table)[i];
+    }
+    *checksum = -sum;
+}
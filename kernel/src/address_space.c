@@ -0,0 +1,83 @@
+#include "address_space.h"
+
+#include "cpu.h"
+#include "paging.h"
+#include "globals.h"
+#include "bitmap.h"
+#include "spinlock.h"
+
+#define PCID_MAP_WORDS ((PCID_COUNT / 64) + 1)  // bitmap words plus one summary word
+
+static bool _pcid_enabled = false;
+static bitmap_t _pcids;                         // set while a PCID belongs to an address space
+static bitmap_t _stale;                         // set while a released PCID may still tag TLB entries
+static uint64_t _pcid_buffer[PCID_MAP_WORDS];
+static uint64_t _stale_buffer[PCID_MAP_WORDS];
+static spinlock_t _lock = SPINLOCK_INIT;
+
+// enables global pages and PCIDs where supported, must run with PCID_KERNEL loaded in CR3
+void address_space_cpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid_regs(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    unsigned long cr4 = read_cr4();
+    if (edx & CPUID_EDX_PGE) cr4 |= CR4_PGE;
+    if (ecx & CPUID_ECX_PCID) {
+        cr4 |= CR4_PCIDE;
+        _pcid_enabled = true;
+    }
+    write_cr4(cr4);
+
+    bitmap_init(&_pcids, PCID_COUNT / 8, _pcid_buffer);
+    bitmap_init(&_stale, PCID_COUNT / 8, _stale_buffer);
+    bitmap_set(&_pcids, PCID_KERNEL);
+}
+
+// any space other than the kernel's own takes over the kernel half of g_pml4, so switching between
+// spaces only swaps out the lower half
+bool address_space_init(address_space_t *space, pml4_t *pml4)
+{
+    if (pml4 != g_pml4) pagetable_share_kernel(pml4, g_pml4);
+    space->pml4 = pml4;
+    space->pcid = PCID_KERNEL;
+    if (!_pcid_enabled) return true;
+
+    spinlock_acquire(&_lock);
+    uint64_t pcid = bitmap_find_first_zero(&_pcids, 0);
+    if (pcid < PCID_COUNT) bitmap_set(&_pcids, pcid);
+    spinlock_release(&_lock);
+
+    if (pcid >= PCID_COUNT) return false;
+    space->pcid = (uint16_t)pcid;
+    return true;
+}
+
+void address_space_release(address_space_t *space)
+{
+    if (space->pcid == PCID_KERNEL) return;
+
+    spinlock_acquire(&_lock);
+    bitmap_set(&_stale, space->pcid);
+    bitmap_clear(&_pcids, space->pcid);
+    spinlock_release(&_lock);
+    space->pcid = PCID_KERNEL;
+}
+
+// keeps the TLB entries tagged with the space's PCID unless a previous owner may have left some behind.
+// invlpg only reaches the current PCID, so non-global changes to a space that is not loaded need a
+// tlb_flush_all before it is switched to again
+void address_space_switch(address_space_t *space)
+{
+    uint64_t cr3 = (virt_to_phys(space->pml4) & PAGE_ADDR_MASK) | (space->pcid & CR3_PCID_MASK);
+    if (_pcid_enabled) {
+        if (bitmap_check(&_stale, space->pcid)) bitmap_clear(&_stale, space->pcid);
+        else cr3 |= CR3_NOFLUSH;
+    }
+    write_cr3(cr3);
+}
+
+bool address_space_pcid_enabled(void)
+{
+    return _pcid_enabled;
+}
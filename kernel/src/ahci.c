@@ -3,7 +3,10 @@
 #include "pageframe_allocator.h"
 #include "globals.h"
 #include "heap.h"
+#include "slab.h"
 #include "memory.h"
+#include "vmap.h"
+#include "cpu.h"
 
 #include "string.h"
 
@@ -11,6 +14,7 @@
 #define ATA_DEV_BUSY            0x80
 #define ATA_DEV_DRQ             0x08
 #define ATA_CMD_READ_DMA_EX     0X25
+#define ATA_CMD_WRITE_DMA_EX    0x35
 #define	SATA_SIG_ATA	        0x00000101	/* SATA drive */
 #define	SATA_SIG_ATAPI	        0xEB140101	/* SATAPI drive */
 #define	SATA_SIG_SEMB	        0xC33C0101	/* Enclosure management bridge */
@@ -22,14 +26,18 @@
 #define HBA_PxCMD_FR            0x4000
 #define HBA_PxCMD_CR            0x8000
 #define HBA_PxIS_TFES           (1 << 30)
+#define HBA_CAP_S64A            (1U << 31)      // 64-bit addressing
+#define HBA_CAP_NCS(cap)        ((((cap) >> 8) & 0x1F) + 1)
 
 static void __probe_ports(hba_mem_t *);
 static AHCI_DEVICE_TYPE __check_device_type(hba_port_t *);
 static void __configure_port(hba_port_t *);
 static void __stop_cmd(hba_port_t *);
 static void __start_cmd(hba_port_t *);
+static void __recover(ahci_port_t *);
 
 static ahci_port_t *_ports[32];
+static kmem_cache_t *_port_cache;
 static uint8_t _port_count = 0;
 
 char buf[128];
@@ -37,8 +45,13 @@ char buf[128];
 void ahci_init(ahci_driver_t *driver, pci_device_hdr_t *pci_base_address)
 {
     driver->pci_base_address = pci_base_address;
-    driver->abar = (hba_mem_t *)((uint64_t)((pci_general_device_t *)pci_base_address)->base_address5);
-    pagetable_map(g_pml4, (void *)(driver->abar), (void *)(driver->abar));
+    uint64_t abar = (uint64_t)((pci_general_device_t *)pci_base_address)->base_address5;
+    // hba_mem_t declares one port, the registers of all 32 run on past it
+    driver->abar = (hba_mem_t *)ioremap(abar, sizeof(hba_mem_t) + (31 * sizeof(hba_port_t)), PAGE_CACHE_UC);
+    if (driver->abar == NULL) return;
+
+    if (_port_cache == NULL) _port_cache = kmem_cache_create("ahci_port", sizeof(ahci_port_t), 0, NULL);
+    if (_port_cache == NULL) return;
 
     __probe_ports(driver->abar);
 
@@ -46,7 +59,7 @@ void ahci_init(ahci_driver_t *driver, pci_device_hdr_t *pci_base_address)
         ahci_port_t *port = _ports[i];
         __configure_port(port->hba_port);
 
-        port->buffer = (uint8_t *)pageframe_request();
+        port->buffer = (uint8_t *)pageframe_request_zone(ZONE_DMA32);
         memzero(port->buffer, PAGE_SIZE);
 
         ahci_read(port, 0, 4, port->buffer);
@@ -58,29 +71,47 @@ void ahci_init(ahci_driver_t *driver, pci_device_hdr_t *pci_base_address)
     }
 }
 
-bool ahci_read(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer)
+// sets up a read or write on a free command slot and issues it without waiting, returning the slot or -1
+// when every slot is busy. commands on one port complete in the order they were issued
+int ahci_issue(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer, bool write)
 {
     uint32_t sectorl = (uint32_t)sector;
     uint32_t sectorh = (uint32_t)(sector >> 32);
 
-    port->hba_port->is = (uint32_t)-1; // clear pending int bits
-    hba_cmd_header_t *cmd = (hba_cmd_header_t *)((uint64_t)port->hba_port->clb);
-    cmd->cfl = sizeof(FIS_TYPE_REG_H2D)/sizeof(uint32_t); // command FIS size
-    cmd->w = 0; // read from device
+    // two cpus must not pick the same free slot and build their commands in the same table
+    uint64_t flags = irq_save();
+    spinlock_acquire(&port->lock);
+
+    uint32_t busy = port->hba_port->sact | port->hba_port->ci;
+    int slot = 0;
+    while (slot < port->command_slots && (busy & (1U << slot))) slot++;
+    if (slot == port->command_slots) {
+        spinlock_release(&port->lock);
+        irq_restore(flags);
+        return -1;
+    }
+
+    if (busy == 0) port->hba_port->is = (uint32_t)-1; // clear pending int bits
+    port->failed &= ~(1U << slot);
+    hba_cmd_header_t *cmd = (hba_cmd_header_t *)phys_to_virt(port->hba_port->clb + ((uint64_t)port->hba_port->clbu << 32)) + slot;
+    cmd->cfl = sizeof(fis_reg_h2d_t)/sizeof(uint32_t); // command FIS size
+    cmd->w = write ? 1 : 0;
     cmd->prdtl = 1;
 
-    hba_cmd_tbl_t *cmdtbl = (hba_cmd_tbl_t *)((uint64_t)cmd->ctba);
+    hba_cmd_tbl_t *cmdtbl = (hba_cmd_tbl_t *)phys_to_virt(cmd->ctba + ((uint64_t)cmd->ctbau << 32));
     memset((void *)cmdtbl, 0, sizeof(hba_cmd_tbl_t) + (cmd->prdtl-1) * sizeof(hba_prdt_entry_t));
 
-    cmdtbl->prdt_entry[0].dba = (uint32_t)(uint64_t)buffer;
-    cmdtbl->prdt_entry[0].dbau = (uint32_t)((uint64_t)buffer >> 32);
+    // buffer has to be a direct map or kernel image address, the HBA is given the physical one
+    uint64_t dba = virt_to_phys(buffer);
+    cmdtbl->prdt_entry[0].dba = (uint32_t)dba;
+    cmdtbl->prdt_entry[0].dbau = (uint32_t)(dba >> 32);
     cmdtbl->prdt_entry[0].dbc = (sector_count << 9) - 1; // 512 bytes per sector
     cmdtbl->prdt_entry[0].i = 1;
 
     fis_reg_h2d_t *fis = (fis_reg_h2d_t *)(&cmdtbl->cfis);
     fis->fis_type = FIS_TYPE_REG_H2D;
     fis->c = 1; // command
-    fis->command = ATA_CMD_READ_DMA_EX;
+    fis->command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
     fis->lba0 = (uint8_t)sectorl;
     fis->lba1 = (uint8_t)(sectorl >> 8);
     fis->lba2 = (uint8_t)(sectorl >> 16);
@@ -91,28 +122,61 @@ bool ahci_read(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *
     fis->countl = sector_count & 0xFF;
     fis->counth = (sector_count >> 8) & 0xFF;
 
-    // The below loop waits until the port is no longer busy before issuing a new command
+    // with nothing outstanding, wait until the port is no longer busy before issuing a new command
     uint64_t spin = 0; // spin lock timeout counter
-    while ((port->hba_port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < MAX_READ_SPIN) {
+    while (busy == 0 && (port->hba_port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < MAX_READ_SPIN) {
         spin++;
     }
 
     if (spin == MAX_READ_SPIN) {
-        return false;
+        spinlock_release(&port->lock);
+        irq_restore(flags);
+        return -1;
     }
 
-    port->hba_port->ci = 1; // issue command
+    port->hba_port->ci = 1U << slot; // issue command
+    spinlock_release(&port->lock);
+    irq_restore(flags);
+    return slot;
+}
 
-    // wait for completion
-    while (true) {
-        if (port->hba_port->ci == 0) break;
-        if (port->hba_port->is & HBA_PxIS_TFES) { 
-            // read unsuccessful
-            return false;
-        }
+// waits for a command from ahci_issue to complete, false only when that command itself failed
+bool ahci_wait(ahci_port_t *port, int slot)
+{
+    uint32_t bit = 1U << slot;
+    while (port->hba_port->ci & bit) {
+        if (port->hba_port->is & HBA_PxIS_TFES) __recover(port);
     }
 
-    return true;
+    uint64_t flags = irq_save();
+    spinlock_acquire(&port->lock);
+    bool done = !(port->failed & bit);
+    port->failed &= ~bit;
+    spinlock_release(&port->lock);
+    irq_restore(flags);
+    return done;
+}
+
+bool ahci_read(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer)
+{
+    int slot = ahci_issue(port, sector, sector_count, buffer, false);
+    return slot >= 0 && ahci_wait(port, slot);
+}
+
+bool ahci_write(ahci_port_t *port, uint64_t sector, uint32_t sector_count, void *buffer)
+{
+    int slot = ahci_issue(port, sector, sector_count, buffer, true);
+    return slot >= 0 && ahci_wait(port, slot);
+}
+
+uint8_t ahci_port_count(void)
+{
+    return _port_count;
+}
+
+ahci_port_t* ahci_port(uint8_t index)
+{
+    return index < _port_count ? _ports[index] : NULL;
 }
 
 static void __probe_ports(hba_mem_t *abar)
@@ -123,10 +187,15 @@ static void __probe_ports(hba_mem_t *abar)
             int dt = __check_device_type(&abar->ports[i]);
 
             if (dt == AHCI_DEVICE_TYPE_SATA || dt == AHCI_DEVICE_TYPE_SATAPI) {
-                ahci_port_t *port = (ahci_port_t *)heap_alloc(sizeof(ahci_port_t));
+                ahci_port_t *port = (ahci_port_t *)kmem_cache_alloc(_port_cache);
+                if (port == NULL) return;
                 port->type = dt;
                 port->hba_port = &abar->ports[i];
                 port->portnum = _port_count;
+                port->command_slots = HBA_CAP_NCS(abar->cap);
+                port->dma64 = (abar->cap & HBA_CAP_S64A) != 0;
+                port->lock = (spinlock_t)SPINLOCK_INIT;
+                port->failed = 0;
                 _ports[_port_count++] = port;
             }            
         }
@@ -160,25 +229,30 @@ static void __configure_port(hba_port_t *port)
     __stop_cmd(port);
 
     //todo: improve memory efficiency (ref: https://wiki.osdev.org/AHCI)
-    uint64_t ahci_base = (uint64_t)pageframe_request();
+    // the port registers are split in to 32-bit halves, keep everything below 4 GiB for HBAs without S64A
+    hba_cmd_header_t *cmd = (hba_cmd_header_t *)pageframe_request_zone(ZONE_DMA32);
+    uint64_t ahci_base = virt_to_phys(cmd);
     port->clb = (uint32_t)ahci_base;
     port->clbu = (uint32_t)(ahci_base >> 32);
-    memset((void *)ahci_base, 0, 1024);
+    memset((void *)cmd, 0, 1024);
 
-    uint64_t fis_base = (uint64_t)pageframe_request();
+    void *fis = pageframe_request_zone(ZONE_DMA32);
+    uint64_t fis_base = virt_to_phys(fis);
     port->fb = (uint32_t)fis_base;
     port->fbu = (uint32_t)(fis_base >> 32);
-    memset((void *)fis_base, 0, 256);
+    memset(fis, 0, 256);
+
+    // 32 command tables of 256b each, packed in to one contiguous 8K block
+    uint8_t *cmdtbl = (uint8_t *)pageframe_request_n_zone(1, ZONE_DMA32);
 
-    hba_cmd_header_t *cmd = (hba_cmd_header_t *)((uint64_t)port->clb + ((uint64_t)port->clbu << 32));
     for (int i = 0; i < 32; i++) {
         // 8 prdt entries per command table, 256b per command table, 64+16+48+16*8
         cmd[i].prdtl = 8;
 
-        uint64_t cmdtbl_addr = (uint64_t)pageframe_request() + (i << 8);
+        uint64_t cmdtbl_addr = virt_to_phys(cmdtbl + (i << 8));
         cmd[i].ctba = (uint32_t)cmdtbl_addr;
         cmd[i].ctbau = (uint32_t)((uint64_t)cmdtbl_addr >> 32);
-        memset((void *)cmdtbl_addr, 0, 256);
+        memset(cmdtbl + (i << 8), 0, 256);
     }
 
     __start_cmd(port);
@@ -209,4 +283,22 @@ static void __stop_cmd(hba_port_t *port)
         if (port->cmd & HBA_PxCMD_CR) continue;
         break;
     }
-}
\ No newline at end of file
+}
+
+// a task file error stops the port with everything outstanding, which all counts as failed. restarting
+// clears ci and the error so later commands are not blamed for it
+static void __recover(ahci_port_t *port)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&port->lock);
+    hba_port_t *hba_port = port->hba_port;
+    if (hba_port->is & HBA_PxIS_TFES) {
+        port->failed |= hba_port->ci;
+        __stop_cmd(hba_port);
+        hba_port->serr = (uint32_t)-1;
+        hba_port->is = HBA_PxIS_TFES;
+        __start_cmd(hba_port);
+    }
+    spinlock_release(&port->lock);
+    irq_restore(flags);
+}
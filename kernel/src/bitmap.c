@@ -1,34 +1,196 @@
 #include "bitmap.h"
 
-#define BYTE_INDEX(index) (index / 8)
-#define MASK(index) (0b10000000 >> (index % 8))
+#define WORD_BITS 64
+#define WORD_INDEX(index) ((index) / WORD_BITS)
+#define MASK(index) (1ULL << ((index) % WORD_BITS))
+#define LOW_MASK(index) (MASK(index) - 1)       // bits below index within its word
+#define WORDS(size) (((size) + 7) / 8)
+#define SUMMARY_WORDS(words) (((words) + WORD_BITS - 1) / WORD_BITS)
+#define FULL ((uint64_t)-1)
+
+// private functions
+static uint64_t __bits(bitmap_t *bitmap);
+static uint64_t __words(bitmap_t *bitmap);
+static uint64_t __find_set_before(bitmap_t *bitmap, uint64_t start, uint64_t limit);
+static void __update_summary(bitmap_t *bitmap, uint64_t word);
+static uint64_t __popcount(uint64_t value);
+
+size_t bitmap_buffer_size(size_t size)
+{
+    size_t words = WORDS(size);
+    return (words + SUMMARY_WORDS(words)) * sizeof(uint64_t);
+}
 
 void bitmap_init(bitmap_t *bitmap, size_t size, void *buffer)
 {
-    bitmap->size = size;
-    bitmap->buffer = (uint8_t *)buffer;
-    unsigned char *ptr = buffer;
-    size_t len = size;
+    size_t words = WORDS(size);
+    size_t summary_words = SUMMARY_WORDS(words);
+
+    bitmap->size = words * sizeof(uint64_t);
+    bitmap->buffer = (uint64_t *)buffer;
+    bitmap->summary = bitmap->buffer + words;
+
+    uint64_t *ptr = bitmap->buffer;
+    size_t len = words + summary_words;
     while (len-- > 0)
         *ptr++ = 0;
+
+    // summary bits past the last word read as full so searches never land on them
+    if (words % WORD_BITS)
+        bitmap->summary[summary_words - 1] = ~LOW_MASK(words);
 }
 
 bool bitmap_check(bitmap_t *bitmap, uint64_t index)
 {
-    if (index > bitmap->size * 8) return false;
-    return (bitmap->buffer[BYTE_INDEX(index)] & MASK(index)) > 0;
+    if (index >= __bits(bitmap)) return false;
+    return (bitmap->buffer[WORD_INDEX(index)] & MASK(index)) > 0;
 }
 
 bool bitmap_set(bitmap_t *bitmap, uint64_t index)
 {
-    if (index > bitmap->size * 8) return false;
-    bitmap->buffer[BYTE_INDEX(index)] |= MASK(index);
+    if (index >= __bits(bitmap)) return false;
+    bitmap->buffer[WORD_INDEX(index)] |= MASK(index);
+    __update_summary(bitmap, WORD_INDEX(index));
     return true;
 }
 
 bool bitmap_clear(bitmap_t *bitmap, uint64_t index)
 {
-    if (index > bitmap->size * 8) return false;
-    bitmap->buffer[BYTE_INDEX(index)] &= ~MASK(index);
+    if (index >= __bits(bitmap)) return false;
+    bitmap->buffer[WORD_INDEX(index)] &= ~MASK(index);
+    bitmap->summary[WORD_INDEX(WORD_INDEX(index))] &= ~MASK(WORD_INDEX(index));
     return true;
 }
+
+uint64_t bitmap_find_first_zero(bitmap_t *bitmap, uint64_t start)
+{
+    if (start >= __bits(bitmap)) return BITMAP_NONE;
+
+    uint64_t word = WORD_INDEX(start);
+    uint64_t value = bitmap->buffer[word] | LOW_MASK(start);
+    if (value != FULL) return (word * WORD_BITS) + __builtin_ctzll(~value);
+
+    // skip over full words using the summary, 64 words per summary word
+    word++;
+    uint64_t words = __words(bitmap);
+    uint64_t summary_words = SUMMARY_WORDS(words);
+    for (uint64_t s = WORD_INDEX(word); s < summary_words; s++) {
+        uint64_t summary = bitmap->summary[s];
+        if (s == WORD_INDEX(word)) summary |= LOW_MASK(word);
+        if (summary == FULL) continue;
+
+        word = (s * WORD_BITS) + __builtin_ctzll(~summary);
+        if (word >= words) return BITMAP_NONE;
+        return (word * WORD_BITS) + __builtin_ctzll(~bitmap->buffer[word]);
+    }
+
+    return BITMAP_NONE;
+}
+
+uint64_t bitmap_find_first_set(bitmap_t *bitmap, uint64_t start)
+{
+    uint64_t bits = __bits(bitmap);
+    uint64_t index = __find_set_before(bitmap, start, bits);
+    return index < bits ? index : BITMAP_NONE;
+}
+
+uint64_t bitmap_find_zero_run(bitmap_t *bitmap, uint64_t start, uint64_t count)
+{
+    if (count == 0) return BITMAP_NONE;
+
+    uint64_t bits = __bits(bitmap);
+    while (true) {
+        uint64_t zero = bitmap_find_first_zero(bitmap, start);
+        if (zero == BITMAP_NONE || zero + count > bits) return BITMAP_NONE;
+
+        uint64_t set = __find_set_before(bitmap, zero, zero + count);
+        if (set == zero + count) return zero;
+        start = set;
+    }
+}
+
+uint64_t bitmap_set_range(bitmap_t *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t bits = __bits(bitmap);
+    if (start >= bits) return 0;
+    if (count > bits - start) count = bits - start;
+    if (count == 0) return 0;
+
+    uint64_t end = start + count;
+    uint64_t changed = 0;
+    for (uint64_t word = WORD_INDEX(start); word <= WORD_INDEX(end - 1); word++) {
+        uint64_t mask = FULL;
+        if (word == WORD_INDEX(start)) mask &= ~LOW_MASK(start);
+        if (word == WORD_INDEX(end - 1) && (end % WORD_BITS)) mask &= LOW_MASK(end);
+
+        uint64_t value = bitmap->buffer[word];
+        changed += __popcount(mask & ~value);
+        bitmap->buffer[word] = value | mask;
+        __update_summary(bitmap, word);
+    }
+    return changed;
+}
+
+uint64_t bitmap_clear_range(bitmap_t *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t bits = __bits(bitmap);
+    if (start >= bits) return 0;
+    if (count > bits - start) count = bits - start;
+    if (count == 0) return 0;
+
+    uint64_t end = start + count;
+    uint64_t changed = 0;
+    for (uint64_t word = WORD_INDEX(start); word <= WORD_INDEX(end - 1); word++) {
+        uint64_t mask = FULL;
+        if (word == WORD_INDEX(start)) mask &= ~LOW_MASK(start);
+        if (word == WORD_INDEX(end - 1) && (end % WORD_BITS)) mask &= LOW_MASK(end);
+
+        uint64_t value = bitmap->buffer[word];
+        changed += __popcount(mask & value);
+        bitmap->buffer[word] = value & ~mask;
+        bitmap->summary[WORD_INDEX(word)] &= ~MASK(word);
+    }
+    return changed;
+}
+
+static uint64_t __bits(bitmap_t *bitmap)
+{
+    return bitmap->size * 8;
+}
+
+static uint64_t __words(bitmap_t *bitmap)
+{
+    return bitmap->size / sizeof(uint64_t);
+}
+
+// returns the first set bit in [start, limit), or limit when there is none
+static uint64_t __find_set_before(bitmap_t *bitmap, uint64_t start, uint64_t limit)
+{
+    if (start >= limit) return limit;
+
+    uint64_t word = WORD_INDEX(start);
+    uint64_t value = bitmap->buffer[word] & ~LOW_MASK(start);
+    while (value == 0) {
+        word++;
+        if (word * WORD_BITS >= limit) return limit;
+        value = bitmap->buffer[word];
+    }
+
+    uint64_t index = (word * WORD_BITS) + __builtin_ctzll(value);
+    return index < limit ? index : limit;
+}
+
+static void __update_summary(bitmap_t *bitmap, uint64_t word)
+{
+    if (bitmap->buffer[word] == FULL)
+        bitmap->summary[WORD_INDEX(word)] |= MASK(word);
+}
+
+// no popcnt without -mpopcnt, and libgcc's fallback is not linked in
+static uint64_t __popcount(uint64_t value)
+{
+    value = value - ((value >> 1) & 0x5555555555555555ULL);
+    value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (value * 0x0101010101010101ULL) >> 56;
+}
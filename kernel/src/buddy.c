@@ -0,0 +1,140 @@
+#include "buddy.h"
+#include "paging.h"
+
+#define ORDER_FRAMES(order) (1UL << (order))
+#define ALIGN_BASE(frame) ((frame) & ~(ORDER_FRAMES(BUDDY_MAX_ORDER) - 1))
+#define BLOCK(frame) ((buddy_block_t *)phys_to_virt((frame) * PAGE_SIZE))
+#define FRAME(block) (virt_to_phys(block) / PAGE_SIZE)
+#define MAP_BYTES(frames, order) ((((frames) >> (order)) / 8) + 1)
+#define MAP_STORAGE(frames, order) bitmap_buffer_size(MAP_BYTES(frames, order))
+
+// private functions
+static bool __is_free(buddy_t *buddy, uint64_t frame, unsigned int order);
+static void __push(buddy_t *buddy, uint64_t frame, unsigned int order);
+static void __remove(buddy_t *buddy, uint64_t frame, unsigned int order);
+
+size_t buddy_metadata_size(uint64_t base, uint64_t frames)
+{
+    uint64_t span = frames + (base - ALIGN_BASE(base));
+    size_t size = 0;
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size += MAP_STORAGE(span, order);
+    }
+    return size;
+}
+
+void buddy_init(buddy_t *buddy, uint64_t base, uint64_t frames, void *buffer)
+{
+    buddy->base = ALIGN_BASE(base);
+    buddy->frames = frames + (base - buddy->base);
+    buddy->free = 0;
+
+    uint8_t *ptr = (uint8_t *)buffer;
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        bitmap_init(&buddy->free_maps[order], MAP_BYTES(buddy->frames, order), ptr);
+        buddy->free_lists[order] = NULL;
+        ptr += MAP_STORAGE(buddy->frames, order);
+    }
+}
+
+uint64_t buddy_alloc(buddy_t *buddy, unsigned int order)
+{
+    if (order > BUDDY_MAX_ORDER) return BUDDY_NONE;
+
+    unsigned int current = order;
+    while (current <= BUDDY_MAX_ORDER && buddy->free_lists[current] == NULL)
+        current++;
+
+    if (current > BUDDY_MAX_ORDER) return BUDDY_NONE;
+
+    uint64_t frame = FRAME(buddy->free_lists[current]);
+    __remove(buddy, frame, current);
+
+    // hand the upper halves back until the block is the requested size
+    while (current > order) {
+        current--;
+        __push(buddy, frame + ORDER_FRAMES(current), current);
+    }
+
+    return frame;
+}
+
+void buddy_free(buddy_t *buddy, uint64_t frame, unsigned int order)
+{
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy_frame = frame ^ ORDER_FRAMES(order);
+        if (!__is_free(buddy, buddy_frame, order)) break;
+
+        __remove(buddy, buddy_frame, order);
+        if (buddy_frame < frame) frame = buddy_frame;
+        order++;
+    }
+
+    __push(buddy, frame, order);
+}
+
+void buddy_free_range(buddy_t *buddy, uint64_t frame, uint64_t count)
+{
+    while (count > 0) {
+        unsigned int order = BUDDY_MAX_ORDER;
+        while (order > 0 && ((frame & (ORDER_FRAMES(order) - 1)) || ORDER_FRAMES(order) > count))
+            order--;
+
+        buddy_free(buddy, frame, order);
+        frame += ORDER_FRAMES(order);
+        count -= ORDER_FRAMES(order);
+    }
+}
+
+bool buddy_reserve(buddy_t *buddy, uint64_t frame)
+{
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint64_t head = frame & ~(ORDER_FRAMES(order) - 1);
+        if (!__is_free(buddy, head, order)) continue;
+
+        __remove(buddy, head, order);
+
+        // split down to the single frame, returning the halves that do not contain it
+        while (order > 0) {
+            order--;
+            uint64_t upper = head + ORDER_FRAMES(order);
+            if (frame >= upper) {
+                __push(buddy, head, order);
+                head = upper;
+            } else {
+                __push(buddy, upper, order);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool __is_free(buddy_t *buddy, uint64_t frame, unsigned int order)
+{
+    if (frame < buddy->base || frame + ORDER_FRAMES(order) > buddy->base + buddy->frames) return false;
+    return bitmap_check(&buddy->free_maps[order], (frame - buddy->base) >> order);
+}
+
+static void __push(buddy_t *buddy, uint64_t frame, unsigned int order)
+{
+    buddy_block_t *block = BLOCK(frame);
+    block->prev = NULL;
+    block->next = buddy->free_lists[order];
+    if (block->next != NULL) block->next->prev = block;
+    buddy->free_lists[order] = block;
+
+    bitmap_set(&buddy->free_maps[order], (frame - buddy->base) >> order);
+    buddy->free += ORDER_FRAMES(order);
+}
+
+static void __remove(buddy_t *buddy, uint64_t frame, unsigned int order)
+{
+    buddy_block_t *block = BLOCK(frame);
+    if (block->prev != NULL) block->prev->next = block->next;
+    else buddy->free_lists[order] = block->next;
+    if (block->next != NULL) block->next->prev = block->prev;
+
+    bitmap_clear(&buddy->free_maps[order], (frame - buddy->base) >> order);
+    buddy->free -= ORDER_FRAMES(order);
+}
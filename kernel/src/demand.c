@@ -0,0 +1,419 @@
+#include "demand.h"
+
+#include "globals.h"
+#include "paging.h"
+#include "pagetable_manager.h"
+#include "pageframe_allocator.h"
+#include "spinlock.h"
+#include "swap.h"
+#include "cpu.h"
+#include "sections.h"
+
+#include <string.h>
+
+#define PAGE_SIZE_2M (1UL << 21)
+#define ENTRY_FRAME(entry) phys_to_virt((entry) & PAGE_ADDR_MASK)   // frames are handled through the direct map
+#define FRAME_ENTRY(frame) (virt_to_phys(frame) & PAGE_ADDR_MASK)
+
+// virtual addresses reserved without frames behind them, each page is backed on first touch
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t touched;                           // end of the highest page ever faulted in, the clock stops here
+    uint64_t flags;
+    bool evictable;                             // the clock may swap its pages out
+} demand_region_t;
+
+static demand_region_t _regions[DEMAND_MAX_REGIONS];
+static size_t _region_count;
+static uint64_t _faults;
+static uint64_t _swap_ins;
+static uint64_t _cow_copies;
+static void *_zero_page;                        // read faults on fresh pages all map this, copy-on-write
+static size_t _hand_region;                     // the clock hand, the next page considered for eviction
+static uint64_t _hand;
+static spinlock_t _lock = SPINLOCK_INIT;        // regions, their page table entries and swap i/o
+
+// private functions
+static demand_region_t* __find_region(uint64_t address);
+static bool __fault_in(demand_region_t *region, uint64_t page, uint64_t error, void *frame, bool *used);
+static bool __break_cow(uint64_t *entry, uint64_t page, void *frame, bool *used);
+static bool __share_page(demand_region_t *region, demand_region_t *source, uint64_t dest, uint64_t src, tlb_batch_t *batch);
+static uint64_t __evict_batch(uint64_t wanted);
+static bool __hand(void);
+static bool __is_private(void *frame);
+static uint64_t __resident_pages(void);
+
+// a region that is not evictable keeps every page it faults in, for memory touched with locks held or
+// interrupts off where a swap-in fault could not be taken
+bool demand_reserve(void *address, size_t pages, uint64_t flags, bool evictable)
+{
+    uint64_t start = (uint64_t)address & PAGE_MASK;
+    uint64_t end = start + (pages * PAGE_SIZE);
+
+    if (_zero_page == NULL) {
+        _zero_page = pageframe_request_zeroed();
+        if (_zero_page == NULL) return false;
+        pageframe_desc(_zero_page)->flags |= PAGEFRAME_FLAG_PINNED;
+
+        // the zero page and copy-on-write pages are only read-only to the kernel itself with WP set
+        write_cr0(read_cr0() | CR0_WP);
+    }
+
+    uint64_t irq = irq_save();
+    spinlock_acquire(&_lock);
+    bool reserved = false;
+    if (_region_count < DEMAND_MAX_REGIONS && __find_region(start) == NULL && __find_region(end - 1) == NULL) {
+        _regions[_region_count].start = start;
+        _regions[_region_count].end = end;
+        _regions[_region_count].touched = start;
+        _regions[_region_count].flags = flags;
+        _regions[_region_count].evictable = evictable;
+        _region_count++;
+        reserved = true;
+    }
+    spinlock_release(&_lock);
+    irq_restore(irq);
+    return reserved;
+}
+
+// forgets the region starting at address, the pages already backed stay mapped for the caller to unmap
+bool demand_release(void *address)
+{
+    uint64_t irq = irq_save();
+    spinlock_acquire(&_lock);
+    bool released = false;
+    for (size_t i = 0; i < _region_count; i++) {
+        if (_regions[i].start != (uint64_t)address) continue;
+        _regions[i] = _regions[--_region_count];
+        released = true;
+        break;
+    }
+    spinlock_release(&_lock);
+    irq_restore(irq);
+    return released;
+}
+
+// called from the page fault handler with interrupts off, for a page in a reserved region. a read of a
+// fresh page maps the shared zero page, a write maps a zeroed frame, a swapped out page is read back and a
+// write to a copy-on-write page gets its own copy. false means the fault is a genuine bug
+HOT_TEXT bool demand_fault(void *address, uint64_t error)
+{
+    if (error & (PF_RESERVED | PF_USER)) return false;
+    if ((error & PF_PRESENT) && !(error & PF_WRITE)) return false;
+
+    // a read of a fresh page needs no frame of its own. the rest take theirs before the lock, running out of
+    // frames swaps pages out under it
+    uint64_t page = (uint64_t)address & PAGE_MASK;
+    uint64_t *entry = pagetable_entry(g_pml4, (void *)page);
+    void *frame = NULL;
+    if ((error & PF_WRITE) || (entry != NULL && IS_SWAP_ENTRY(*entry))) {
+        frame = pageframe_request_zeroed();
+        if (frame == NULL) return false;
+    }
+
+    bool used = false;
+    spinlock_acquire(&_lock);
+    demand_region_t *region = __find_region(page);
+    bool handled = region != NULL && __fault_in(region, page, error, frame, &used);
+    spinlock_release(&_lock);
+
+    if (frame != NULL && !used) pageframe_free(frame);
+    return handled;
+}
+
+// unmaps pages of a demand region, handing back their frames, swap slots and the page tables left
+// empty. they fault back in zeroed
+void demand_unmap(void *address, size_t pages)
+{
+    void *frames[TLB_BATCH_MAX];
+    void *start = address;
+    size_t total = pages;
+
+    uint64_t irq = irq_save();
+    spinlock_acquire(&_lock);
+    while (pages > 0) {
+        size_t count = pages < TLB_BATCH_MAX ? pages : TLB_BATCH_MAX;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t *entry = pagetable_entry(g_pml4, (void *)((uint64_t)address + (i * PAGE_SIZE)));
+            frames[i] = NULL;
+            if (entry == NULL) continue;
+
+            if (*entry & PAGE_BIT_P_PRESENT) {
+                frames[i] = ENTRY_FRAME(*entry);
+            } else if (IS_SWAP_ENTRY(*entry)) {
+                swap_free(SWAP_SLOT(*entry));
+                *entry = 0;
+            }
+        }
+
+        // no frame is freed while a stale translation to it may remain
+        pagetable_unmap_range(g_pml4, address, count, NULL);
+        for (size_t i = 0; i < count; i++) {
+            if (frames[i] != NULL) pageframe_free(frames[i]);
+        }
+
+        address = (void *)((uint64_t)address + (count * PAGE_SIZE));
+        pages -= count;
+    }
+    pagetable_free_tables(g_pml4, start, total);
+    spinlock_release(&_lock);
+    irq_restore(irq);
+}
+
+// maps the pages behind src at dest as well, both sides copy-on-write, so neither copies a page until it
+// writes to it. each range must lie in a single demand region and dest must be unmapped. pages of src never
+// touched are left for dest to fault in on its own. on false dest may be partly mapped, for the caller to unmap
+bool demand_share(void *dest, void *src, size_t pages)
+{
+    uint64_t dest_start = (uint64_t)dest & PAGE_MASK;
+    uint64_t src_start = (uint64_t)src & PAGE_MASK;
+    uint64_t length = pages * PAGE_SIZE;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+
+    uint64_t irq = irq_save();
+    spinlock_acquire(&_lock);
+    demand_region_t *region = __find_region(dest_start);
+    demand_region_t *source = __find_region(src_start);
+    bool shared = region != NULL && __find_region(dest_start + length - 1) == region
+        && source != NULL && __find_region(src_start + length - 1) == source;
+
+    for (uint64_t offset = 0; shared && offset < length; offset += PAGE_SIZE) {
+        shared = __share_page(region, source, dest_start + offset, src_start + offset, &batch);
+    }
+    if (shared && dest_start + length > region->touched) region->touched = dest_start + length;
+
+    tlb_batch_flush(&batch);
+    spinlock_release(&_lock);
+    irq_restore(irq);
+    return shared;
+}
+
+// second chance over the pages resident in demand regions: one accessed since the hand last passed has
+// the bit cleared and is skipped, one that was not is written to swap and its frame freed. called by the
+// frame allocator when it comes up empty, so nothing here may allocate. returns the frames freed
+uint64_t demand_evict(uint64_t frames)
+{
+    if (!swap_enabled()) return 0;
+
+    // a fault already holding the lock may be what ran the allocator dry
+    uint64_t irq = irq_save();
+    if (!spinlock_try_acquire(&_lock)) {
+        irq_restore(irq);
+        return 0;
+    }
+
+    uint64_t evicted = 0;
+    while (evicted < frames) {
+        uint64_t count = __evict_batch(frames - evicted);
+        if (count == 0) break;
+        evicted += count;
+    }
+    spinlock_release(&_lock);
+    irq_restore(irq);
+    return evicted;
+}
+
+uint64_t demand_faults(void)
+{
+    return _faults;
+}
+
+uint64_t demand_swap_ins(void)
+{
+    return _swap_ins;
+}
+
+uint64_t demand_cow_copies(void)
+{
+    return _cow_copies;
+}
+
+static demand_region_t* __find_region(uint64_t address)
+{
+    for (size_t i = 0; i < _region_count; i++) {
+        if (address >= _regions[i].start && address < _regions[i].end) return &_regions[i];
+    }
+    return NULL;
+}
+
+// *used is set once frame is mapped, another cpu may have faulted the page in first
+static bool __fault_in(demand_region_t *region, uint64_t page, uint64_t error, void *frame, bool *used)
+{
+    uint64_t *entry = pagetable_entry(g_pml4, (void *)page);
+    if (entry != NULL && (*entry & PAGE_BIT_P_PRESENT)) {
+        if (!(error & PF_WRITE) || (*entry & PAGE_BIT_RW_WRITABLE)) return true;
+        return (*entry & PAGE_BIT_COW) && __break_cow(entry, page, frame, used);
+    }
+
+    // swapped out since the handler looked, returning without a mapping makes the access fault again
+    if (entry != NULL && IS_SWAP_ENTRY(*entry) && frame == NULL) return true;
+
+    if (entry != NULL && IS_SWAP_ENTRY(*entry)) {
+        uint64_t slot = SWAP_SLOT(*entry);
+        if (!swap_read(slot, frame)) return false;
+        swap_free(slot);
+        *entry = 0;
+        _swap_ins++;
+    } else if (!(error & PF_WRITE)) {
+        uint64_t flags = (region->flags & ~PAGE_BIT_RW_WRITABLE) | PAGE_BIT_COW;
+        if (!pagetable_map_range(g_pml4, (void *)page, (void *)virt_to_phys(_zero_page), 1, flags, PAGE_CACHE_WB)) return false;
+        _faults++;
+        if (page + PAGE_SIZE > region->touched) region->touched = page + PAGE_SIZE;
+        return true;
+    }
+
+    if (!pagetable_map_range(g_pml4, (void *)page, (void *)virt_to_phys(frame), 1, region->flags, PAGE_CACHE_WB)) return false;
+    pageframe_set_owner(frame, PAGEFRAME_OWNER_DEMAND);
+    *used = true;
+    _faults++;
+    if (page + PAGE_SIZE > region->touched) region->touched = page + PAGE_SIZE;
+    return true;
+}
+
+// the last mapping of a shared frame takes it over, any other gets a copy. the zero page is never taken
+// over and needs no copying, frame is already zeroed
+static bool __break_cow(uint64_t *entry, uint64_t page, void *frame, bool *used)
+{
+    void *shared = ENTRY_FRAME(*entry);
+    pageframe_desc_t *desc = pageframe_desc(shared);
+
+    if (desc != NULL && desc->refcount == 0 && !(desc->flags & PAGEFRAME_FLAG_PINNED)) {
+        *entry = (*entry & ~PAGE_BIT_COW) | PAGE_BIT_RW_WRITABLE;
+    } else {
+        if (shared != _zero_page) memcpy(frame, shared, PAGE_SIZE);
+        pageframe_set_owner(frame, PAGEFRAME_OWNER_DEMAND);
+        *entry = FRAME_ENTRY(frame) | (*entry & ~PAGE_ADDR_MASK & ~PAGE_BIT_COW) | PAGE_BIT_RW_WRITABLE;
+        *used = true;
+        pageframe_free(shared); // only drops the reference
+        _cow_copies++;
+    }
+    invlpg((void *)page);
+    return true;
+}
+
+// shares one page of src with dest, reading it back from swap first when it has been swapped out. each
+// side keeps the flags of its own region
+static bool __share_page(demand_region_t *region, demand_region_t *source, uint64_t dest, uint64_t src, tlb_batch_t *batch)
+{
+    uint64_t *target = pagetable_entry(g_pml4, (void *)dest);
+    if (target != NULL && *target != 0) return false;
+
+    uint64_t *entry = pagetable_entry(g_pml4, (void *)src);
+    if (entry == NULL || *entry == 0) return true;
+
+    if (IS_SWAP_ENTRY(*entry)) {
+        // eviction cannot run under the lock, the frame has to come from what is free
+        void *frame = pageframe_request();
+        uint64_t slot = SWAP_SLOT(*entry);
+        if (frame == NULL || !swap_read(slot, frame)) {
+            if (frame != NULL) pageframe_free(frame);
+            return false;
+        }
+        swap_free(slot);
+        pageframe_set_owner(frame, PAGEFRAME_OWNER_DEMAND);
+        *entry = FRAME_ENTRY(frame) | source->flags | PAGE_BIT_P_PRESENT;
+    }
+
+    void *frame = ENTRY_FRAME(*entry);
+    uint64_t flags = (region->flags & ~PAGE_BIT_RW_WRITABLE) | PAGE_BIT_COW;
+    if (!pagetable_map_range(g_pml4, (void *)dest, (void *)virt_to_phys(frame), 1, flags, PAGE_CACHE_WB)) return false;
+    if (frame != _zero_page) pageframe_get(frame);
+
+    if (*entry & PAGE_BIT_RW_WRITABLE) {
+        *entry = (*entry & ~PAGE_BIT_RW_WRITABLE) | PAGE_BIT_COW;
+        tlb_batch_add(batch, (void *)src);
+    }
+    return true;
+}
+
+// picks up to a batch of victims in at most two sweeps of the clock, then writes them out together
+static uint64_t __evict_batch(uint64_t wanted)
+{
+    uint64_t *entries[SWAP_BATCH];
+    uint64_t values[SWAP_BATCH];
+    int commands[SWAP_BATCH];
+    size_t count = 0;
+    if (wanted > SWAP_BATCH) wanted = SWAP_BATCH;
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    uint64_t budget = __resident_pages() * 2;
+    while (count < wanted && budget > 0 && __hand()) {
+        uint64_t *entry = pagetable_entry(g_pml4, (void *)_hand);
+        uint64_t step = 1;
+
+        if (entry == NULL) {
+            step = (PAGE_SIZE_2M - (_hand & (PAGE_SIZE_2M - 1))) / PAGE_SIZE;
+        } else if ((*entry & PAGE_BIT_P_PRESENT) && (*entry & PAGE_BIT_A_ACCESSED)) {
+            *entry &= ~PAGE_BIT_A_ACCESSED;
+            tlb_batch_add(&batch, (void *)_hand);
+        } else if ((*entry & PAGE_BIT_P_PRESENT) && !__is_private(ENTRY_FRAME(*entry))) {
+            // a shared frame would have to be swapped out of every mapping at once
+        } else if (*entry & PAGE_BIT_P_PRESENT) {
+            uint64_t slot = swap_alloc();
+            if (slot == SWAP_NONE) break;
+
+            entries[count] = entry;
+            values[count] = *entry;
+            *entry = SWAP_ENTRY(slot);
+            tlb_batch_add(&batch, (void *)_hand);
+            count++;
+        }
+
+        _hand += step * PAGE_SIZE;
+        budget -= step < budget ? step : budget;
+    }
+
+    // the entries are gone before the frames are written, nothing can change a page mid-write
+    tlb_batch_flush(&batch);
+    for (size_t i = 0; i < count; i++) {
+        commands[i] = swap_write_begin(i, SWAP_SLOT(*entries[i]), ENTRY_FRAME(values[i]));
+    }
+
+    uint64_t evicted = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (swap_write_end(commands[i])) {
+            pageframe_free(ENTRY_FRAME(values[i]));
+            evicted++;
+        } else {
+            swap_free(SWAP_SLOT(*entries[i]));
+            *entries[i] = values[i];
+        }
+    }
+    return evicted;
+}
+
+// moves the hand on to the next region when it has run past the pages touched in its own, false when
+// no region has any
+static bool __hand(void)
+{
+    for (size_t tries = 0; tries <= _region_count; tries++) {
+        if (_hand_region < _region_count) {
+            demand_region_t *region = &_regions[_hand_region];
+            if (_hand < region->start) _hand = region->start;
+            if (region->evictable && _hand < region->touched) return true;
+        }
+
+        _hand_region = (_hand_region + 1) % (_region_count > 0 ? _region_count : 1);
+        _hand = 0;
+    }
+    return false;
+}
+
+static uint64_t __resident_pages(void)
+{
+    uint64_t pages = 0;
+    for (size_t i = 0; i < _region_count; i++) {
+        if (_regions[i].evictable) pages += (_regions[i].touched - _regions[i].start) / PAGE_SIZE;
+    }
+    return pages;
+}
+
+static bool __is_private(void *frame)
+{
+    pageframe_desc_t *desc = pageframe_desc(frame);
+    return desc != NULL && desc->refcount == 0 && !(desc->flags & PAGEFRAME_FLAG_PINNED);
+}
@@ -2,25 +2,74 @@
 
 #include "globals.h"
 #include "pagetable_manager.h"
-#include "pageframe_allocator.h"
 #include "paging.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "heap_arena.h"
+#include "demand.h"
+#include "vmap.h"
+#include "sections.h"
+
+#include <string.h>
+
+#define SMALL_LIMIT 0x100                   // sizes up to here get one class per 16 bytes
+#define SMALL_CLASSES (SMALL_LIMIT / 0x10)
+#define CLASS_COUNT 64                      // one bit each in _nonempty_classes
+#define LINKS(segment) ((heap_links_t *)((uint64_t)(segment) + sizeof(heap_hdr_t)))
+
+#define DIRECT_THRESHOLD 0x10000            // allocations this large get pages of their own
+#define DIRECT_OFFSET (HEAP_WINDOW_SIZE / 2)  // which are mapped from half way through the heap's window
+#define DIRECT_MAGIC 0x7463657269647068     // "hpdirect"
+#define TRIM_THRESHOLD 0x20000              // free segments this large hand their whole pages back
+#define PAGE_UP(address) (((uint64_t)(address) + PAGE_SIZE - 1) & PAGE_MASK)
+#define PAGE_DOWN(address) ((uint64_t)(address) & PAGE_MASK)
+
+// free-list links, kept in the payload of free segments
+typedef struct {
+    heap_hdr_t *next;
+    heap_hdr_t *prev;
+} heap_links_t;
+
+// at the base of a direct allocation's pages
+typedef struct {
+    uint64_t magic;
+    size_t pages;
+} heap_direct_t;
 
 static void *_heap_start;
 static void *_heap_end;
 static heap_hdr_t *_last_segment;
+static heap_hdr_t *_free_lists[CLASS_COUNT];
+static uint64_t _nonempty_classes;
+static uint64_t _alloc_worst_cycles;
+static void *_direct_start;
+static vmap_space_t _direct;                // ranges for direct allocations, reused once freed
+static spinlock_t _lock = SPINLOCK_INIT;    // the central heap, segments and direct allocations
 
+static void* __alloc_locked(size_t size);
+static bool __resize_locked(void *ptr, size_t size, size_t *length);
+static void __free_locked(void *address);
+static void __free_segment(heap_hdr_t*);
+static void __move(void *dest, void *src, size_t length);
 static bool __expand(size_t length);
 static bool __combine_next(heap_hdr_t*);
 static bool __combine_prev(heap_hdr_t*);
 static bool __split(heap_hdr_t*, size_t);
+static unsigned int __class(size_t length);
+static size_t __class_base(unsigned int class);
+static heap_hdr_t* __find_free(size_t size);
+static void __link(heap_hdr_t*);
+static void __unlink(heap_hdr_t*);
+static void __release_tail(heap_hdr_t*, size_t);
+static void* __alloc_direct(size_t size);
+static heap_direct_t* __find_direct(void *address);
+static void __trim(heap_hdr_t*, uint64_t, uint64_t);
 
+// nothing is mapped up front, the heap and direct windows fault their pages in on first touch. they
+// are never swapped out, kernel objects on the heap are used with locks held and interrupts off
 void heap_init(void *address, size_t pages)
 {
-    void *ptr = address;
-    for (int i = 0; i < pages; i++) {
-        pagetable_map(g_pml4, ptr, pageframe_request());
-        ptr = (void *)((size_t)ptr + PAGE_SIZE);
-    }
+    if (address == NULL || !demand_reserve(address, (DIRECT_OFFSET * 2) / PAGE_SIZE, PAGE_KERNEL_FLAGS, false)) return;
 
     size_t len = pages * PAGE_SIZE;
     _heap_start = address;
@@ -31,56 +80,202 @@ void heap_init(void *address, size_t pages)
     first_segment->prev = NULL;
     first_segment->free = true;
     _last_segment = first_segment;
+    __link(first_segment);
+
+    _direct_start = (void *)((uint64_t)address + DIRECT_OFFSET);
+    vmap_space_init(&_direct, _direct_start, DIRECT_OFFSET / PAGE_SIZE);
+}
+
+// small requests come from the running CPU's arena, everything else from the central heap
+HOT_TEXT void* heap_alloc(size_t size)
+{
+    if (size == 0) return NULL;
+    if (size <= HEAP_ARENA_LIMIT) return heap_arena_alloc(size);
 
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    void *alloc = __alloc_locked(size);
+    spinlock_release(&_lock);
+    irq_restore(flags);
+    return alloc;
 }
 
-void* heap_alloc(size_t size)
+// direct allocations are unmapped when freed, their pages always fault in already zeroed
+void* heap_calloc(size_t size)
+{
+    void *alloc = heap_alloc(size);
+    if (alloc != NULL && __find_direct(alloc) == NULL) memzero(alloc, size);
+    return alloc;
+}
+
+// resizes in place when it can, otherwise moves the allocation
+void* heap_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) return heap_alloc(size);
+    if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    }
+
+    size_t length;
+    if (ptr < _heap_start) {
+        length = heap_arena_size(ptr);
+        if (size <= length) return ptr;
+    } else {
+        uint64_t flags = irq_save();
+        spinlock_acquire(&_lock);
+        bool resized = __resize_locked(ptr, size, &length);
+        spinlock_release(&_lock);
+        irq_restore(flags);
+        if (resized) return ptr;
+    }
+
+    void *moved = heap_alloc(size);
+    if (moved == NULL) return NULL;
+    __move(moved, ptr, length < size ? length : size);
+    heap_free(ptr);
+    return moved;
+}
+
+// arena objects live in frames below the heap, which the CPU that freed them need not own
+HOT_TEXT void heap_free(void *address)
+{
+    if (address == NULL) return;
+    if (address < _heap_start) {
+        heap_arena_free(address);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    __free_locked(address);
+    spinlock_release(&_lock);
+    irq_restore(flags);
+}
+
+uint64_t heap_alloc_worst_cycles(void)
+{
+    return _alloc_worst_cycles;
+}
+
+static void* __alloc_locked(size_t size)
 {
     if (size % 0x10) {
         size -= (size % 0x10);
         size += 0x10;
     }
 
-    if (size == 0) return NULL;
+    if (size >= DIRECT_THRESHOLD) return __alloc_direct(size);
+    uint64_t start = rdtsc();
+
+    heap_hdr_t *segment = __find_free(size);
+    if (segment == NULL) {
+        if (!__expand(size + sizeof(heap_hdr_t))) return NULL;
+        segment = __find_free(size);
+        if (segment == NULL) return NULL;
+    }
+
+    if (segment->length > size)
+        __split(segment, size);
+
+    __unlink(segment);
+    segment->free = false;
+
+    uint64_t cycles = rdtsc() - start;
+    if (cycles > _alloc_worst_cycles) _alloc_worst_cycles = cycles;
+    return (void *)((uint64_t)segment + sizeof(heap_hdr_t));
+}
 
-    heap_hdr_t *current_segment = (heap_hdr_t *)_heap_start;
-    while (true) {
-        if (current_segment->free) {
-            if (current_segment->length >= size) {
-                if (current_segment->length > size)
-                    __split(current_segment, size);
+// grows or shrinks in place, absorbing a free segment after this one when growing. length is set to
+// what the allocation held before, for the caller to move on false
+static bool __resize_locked(void *ptr, size_t size, size_t *length)
+{
+    if (size % 0x10) {
+        size -= (size % 0x10);
+        size += 0x10;
+    }
 
-                current_segment->free = false;
-                return (void *)((uint64_t)current_segment + sizeof(heap_hdr_t));
-            }
-        }
+    heap_direct_t *direct = __find_direct(ptr);
+    if (direct != NULL) {
+        *length = (direct->pages * PAGE_SIZE) - sizeof(heap_direct_t);
+        return size <= *length;
+    }
 
-        if (current_segment->next == NULL) break;
-        current_segment = current_segment->next;
+    heap_hdr_t *segment = (heap_hdr_t *)((uint64_t)ptr - sizeof(heap_hdr_t));
+    *length = segment->length;
+    if (size >= DIRECT_THRESHOLD) return false;
+
+    if (segment->length < size) {
+        size_t available = segment->length;
+        if (segment->next != NULL && segment->next->free)
+            available += sizeof(heap_hdr_t) + segment->next->length;
+
+        // at the end of the heap, grow it so the new space lands right after the segment
+        if (available < size && (segment == _last_segment || segment->next == _last_segment))
+            if (__expand(size - available + sizeof(heap_hdr_t))) available = size;
+
+        if (available >= size) __combine_next(segment);
     }
 
-    __expand(size);
-    return heap_alloc(size);
+    if (segment->length < size) return false;
+    __release_tail(segment, size);
+    return true;
 }
 
-void* heap_calloc(size_t size)
+// a direct allocation grown into another shares its pages copy-on-write with the new one instead of
+// copying them, only the first page holding the header is copied
+static void __move(void *dest, void *src, size_t length)
 {
-    void *alloc = heap_alloc(size);
-    memzero(alloc, size);
-    return alloc;
+    heap_direct_t *to = __find_direct(dest);
+    heap_direct_t *from = __find_direct(src);
+    if (to == NULL || from == NULL || to->pages < from->pages || from->pages < 2) {
+        memcpy(dest, src, length);
+        return;
+    }
+
+    void *dest_rest = (void *)((uint64_t)to + PAGE_SIZE);
+    void *src_rest = (void *)((uint64_t)from + PAGE_SIZE);
+    if (!demand_share(dest_rest, src_rest, from->pages - 1)) {
+        demand_unmap(dest_rest, from->pages - 1);
+        memcpy(dest, src, length);
+        return;
+    }
+    memcpy(dest, src, PAGE_SIZE - sizeof(heap_direct_t));
 }
 
-void* heap_realloc(void *ptr, size_t size)
+static void __free_locked(void *address)
 {
+    heap_direct_t *direct = __find_direct(address);
+    if (direct != NULL) {
+        demand_unmap(direct, direct->pages);
+        vmap_space_release(&_direct, direct);
+        return;
+    }
 
+    __free_segment((heap_hdr_t *)((uint64_t)address - sizeof(heap_hdr_t)));
 }
 
-void heap_free(void *address)
+// merges a segment that just became free with its free neighbours and trims what was not free before.
+// a neighbour below TRIM_THRESHOLD was never trimmed, a larger one only keeps its links mapped
+static void __free_segment(heap_hdr_t *segment)
 {
-    heap_hdr_t *segment = (heap_hdr_t *)((uint64_t)address - sizeof(heap_hdr_t));
+    heap_hdr_t *prev = segment->prev != NULL && segment->prev->free ? segment->prev : NULL;
+    heap_hdr_t *next = segment->next != NULL && segment->next->free ? segment->next : NULL;
+
+    uint64_t start = (uint64_t)segment;
+    uint64_t end = (uint64_t)segment + sizeof(heap_hdr_t) + segment->length;
+    if (prev != NULL && prev->length < TRIM_THRESHOLD) start = (uint64_t)prev;
+    if (next != NULL) {
+        end = next->length < TRIM_THRESHOLD
+            ? (uint64_t)next + sizeof(heap_hdr_t) + next->length
+            : (uint64_t)next + sizeof(heap_hdr_t) + sizeof(heap_links_t);
+    }
+
     segment->free = true;
+    __link(segment);
     __combine_next(segment);
     __combine_prev(segment);
+    __trim(prev != NULL ? prev : segment, start, end);
 }
 
 static bool __expand(size_t length)
@@ -90,13 +285,9 @@ static bool __expand(size_t length)
         length += PAGE_SIZE;
     }
 
-    size_t pages = length / PAGE_SIZE;
     heap_hdr_t *segment = (heap_hdr_t *)_heap_end;
-
-    for (size_t i = 0; i < pages; i++) {
-        pagetable_map(g_pml4, _heap_end, pageframe_request());
-        _heap_end = (void *)((size_t)_heap_end + PAGE_SIZE);
-    }
+    if ((uint64_t)_heap_end + length > (uint64_t)_direct_start) return false;
+    _heap_end = (void *)((size_t)_heap_end + length);
 
     segment->free = true;
     segment->prev = _last_segment;
@@ -104,6 +295,7 @@ static bool __expand(size_t length)
     _last_segment = segment;
     segment->next = NULL;
     segment->length = length - sizeof(heap_hdr_t);
+    __link(segment);
     __combine_prev(segment);
 
     return true;
@@ -112,11 +304,15 @@ static bool __expand(size_t length)
 static bool __combine_next(heap_hdr_t *segment)
 {
     if (segment->next == NULL || !segment->next->free) return false;
+    __unlink(segment->next);
+    if (segment->free) __unlink(segment);
+
     if (segment->next == _last_segment) _last_segment = segment;
     if (segment->next->next != NULL) segment->next->next->prev = segment;
     segment->length += (segment->next->length + sizeof(heap_hdr_t));
     segment->next = segment->next->next;
 
+    if (segment->free) __link(segment);
     return true;
 }
 
@@ -133,8 +329,10 @@ static bool __split(heap_hdr_t *segment, size_t length)
     int64_t remaining = segment->length - sizeof(heap_hdr_t) - length;
     if (remaining < 0x10) return false;
 
+    if (segment->free) __unlink(segment);
+
     heap_hdr_t *split = (heap_hdr_t *)((size_t)segment + sizeof(heap_hdr_t) + length);
-    segment->next->prev = split;
+    if (segment->next != NULL) segment->next->prev = split;
     split->next = segment->next;
     segment->next = split;
     split->prev = segment;
@@ -143,5 +341,113 @@ static bool __split(heap_hdr_t *segment, size_t length)
     segment->length = length;
 
     if (_last_segment == segment) _last_segment = split;
+    if (segment->free) {
+        __link(segment);
+        __link(split);
+    }
     return true;
+}
+
+static void* __alloc_direct(size_t size)
+{
+    size_t pages = PAGE_UP(size + sizeof(heap_direct_t)) / PAGE_SIZE;
+    heap_direct_t *direct = (heap_direct_t *)vmap_space_reserve(&_direct, pages);
+    if (direct == NULL) return NULL;
+    direct->magic = DIRECT_MAGIC;
+    direct->pages = pages;
+    return (void *)((uint64_t)direct + sizeof(heap_direct_t));
+}
+
+static heap_direct_t* __find_direct(void *address)
+{
+    if (address < _direct_start || (uint64_t)address >= (uint64_t)_direct_start + DIRECT_OFFSET) return NULL;
+
+    heap_direct_t *direct = (heap_direct_t *)((uint64_t)address - sizeof(heap_direct_t));
+    return direct->magic == DIRECT_MAGIC ? direct : NULL;
+}
+
+// unmaps the pages touching [start, end) that lie wholly inside a large free segment, past its links.
+// they fault back in zeroed once reused
+static void __trim(heap_hdr_t *segment, uint64_t start, uint64_t end)
+{
+    if (segment->length < TRIM_THRESHOLD) return;
+
+    uint64_t first = PAGE_UP((uint64_t)segment + sizeof(heap_hdr_t) + sizeof(heap_links_t));
+    uint64_t last = PAGE_DOWN((uint64_t)segment + sizeof(heap_hdr_t) + segment->length);
+    start = PAGE_DOWN(start) > first ? PAGE_DOWN(start) : first;
+    end = PAGE_UP(end) < last ? PAGE_UP(end) : last;
+    if (end > start) demand_unmap((void *)start, (end - start) / PAGE_SIZE);
+}
+
+// splits whatever an allocated segment holds past length off in to a free segment
+static void __release_tail(heap_hdr_t *segment, size_t length)
+{
+    if (!__split(segment, length)) return;
+
+    __free_segment(segment->next);
+}
+
+// 16-byte classes up to SMALL_LIMIT, then four classes per power of two
+static unsigned int __class(size_t length)
+{
+    if (length <= SMALL_LIMIT) return (length / 0x10) - 1;
+
+    unsigned int log = 63 - __builtin_clzll(length);
+    unsigned int class = SMALL_CLASSES + ((log - 8) * 4) + ((length >> (log - 2)) & 3);
+    return class < CLASS_COUNT ? class : CLASS_COUNT - 1;
+}
+
+// the smallest length held in a class
+static size_t __class_base(unsigned int class)
+{
+    if (class < SMALL_CLASSES) return (class + 1) * 0x10;
+
+    unsigned int log = 8 + ((class - SMALL_CLASSES) / 4);
+    return (1UL << log) + ((size_t)((class - SMALL_CLASSES) % 4) << (log - 2));
+}
+
+// any segment in a class above the one size falls in fits, so the search is a bit scan. only the size's
+// own class, holding segments both smaller and larger than it, and the unbounded last class are walked
+static heap_hdr_t* __find_free(size_t size)
+{
+    unsigned int class = __class(size);
+    unsigned int fit = class;
+    if (size > __class_base(class) && fit < CLASS_COUNT - 1) fit++;
+
+    uint64_t candidates = _nonempty_classes & (~0ULL << fit);
+    if (candidates != 0) {
+        fit = __builtin_ctzll(candidates);
+        if (fit < CLASS_COUNT - 1) return _free_lists[fit];
+    }
+
+    for (heap_hdr_t *segment = _free_lists[class]; segment != NULL; segment = LINKS(segment)->next) {
+        if (segment->length >= size) return segment;
+    }
+    if (class == CLASS_COUNT - 1 || fit != CLASS_COUNT - 1) return NULL;
+
+    for (heap_hdr_t *segment = _free_lists[fit]; segment != NULL; segment = LINKS(segment)->next) {
+        if (segment->length >= size) return segment;
+    }
+    return NULL;
+}
+
+static void __link(heap_hdr_t *segment)
+{
+    unsigned int class = __class(segment->length);
+    heap_links_t *links = LINKS(segment);
+    links->prev = NULL;
+    links->next = _free_lists[class];
+    if (links->next != NULL) LINKS(links->next)->prev = segment;
+    _free_lists[class] = segment;
+    _nonempty_classes |= 1ULL << class;
+}
+
+static void __unlink(heap_hdr_t *segment)
+{
+    unsigned int class = __class(segment->length);
+    heap_links_t *links = LINKS(segment);
+    if (links->prev != NULL) LINKS(links->prev)->next = links->next;
+    else _free_lists[class] = links->next;
+    if (links->next != NULL) LINKS(links->next)->prev = links->prev;
+    if (_free_lists[class] == NULL) _nonempty_classes &= ~(1ULL << class);
 }
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "heap_arena.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "percpu.h"
+#include "paging.h"
+#include "pageframe_allocator.h"
+#include "sections.h"
+
+#define ARENA_CLASSES (HEAP_ARENA_LIMIT / 0x10)
+#define CLASS(size) ((((size) + 0xF) / 0x10) - 1)
+#define CLASS_SIZE(class) (((class) + 1) * 0x10)
+#define SPAN(address) ((heap_span_t *)((uint64_t)(address) & PAGE_MASK))
+#define SPAN_OFFSET ((sizeof(heap_span_t) + 0xF) & ~0xFUL)
+#define SPAN_MAGIC 0x6e61707370616568   // "heapspan"
+
+// one frame of same-sized objects, owned by the CPU whose arena carved it
+typedef struct heap_span_t heap_span_t;
+struct heap_span_t {
+    uint64_t magic;
+    uint32_t cpu;                       // the owner, the only CPU touching anything but remote
+    uint32_t class;
+    heap_span_t *next;
+    heap_span_t *prev;
+    void *free;                         // owner's free list, each object holds a pointer to the next
+    void *remote;                       // objects freed by other CPUs, pushed with compare-and-swap
+    uint32_t inuse;                     // handed out and not yet back on free
+    uint32_t capacity;
+    bool full;                          // on the arena's full list rather than partial
+};
+
+typedef struct {
+    heap_span_t *partial[ARENA_CLASSES];    // spans with objects on their free list
+    heap_span_t *full[ARENA_CLASSES];       // spans waiting for frees, checked for remote ones on a miss
+} heap_arena_t;
+
+static heap_arena_t _arenas[MAX_CPUS];
+
+// private functions
+static heap_span_t* __create_span(heap_arena_t *arena, uint32_t cpu, unsigned int class);
+static heap_span_t* __reclaim_full(heap_arena_t *arena, unsigned int class);
+static void __collect(heap_span_t *span);
+static void __push(heap_span_t **list, heap_span_t *span);
+static void __remove(heap_span_t **list, heap_span_t *span);
+
+// the fast path touches only the running CPU's arena, so it needs no lock, just interrupts held off
+HOT_TEXT void* heap_arena_alloc(size_t size)
+{
+    if (size == 0 || size > HEAP_ARENA_LIMIT) return NULL;
+    unsigned int class = CLASS(size);
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+    heap_arena_t *arena = &_arenas[cpu];
+
+    heap_span_t *span = arena->partial[class];
+    if (span == NULL) span = __reclaim_full(arena, class);
+    if (span == NULL) span = __create_span(arena, cpu, class);
+    if (span == NULL) {
+        irq_restore(flags);
+        return NULL;
+    }
+
+    void *object = span->free;
+    span->free = *(void **)object;
+    span->inuse++;
+
+    if (span->free == NULL) {
+        __collect(span);
+        if (span->free == NULL) {
+            __remove(&arena->partial[class], span);
+            __push(&arena->full[class], span);
+            span->full = true;
+        }
+    }
+
+    irq_restore(flags);
+    return object;
+}
+
+HOT_TEXT void heap_arena_free(void *address)
+{
+    heap_span_t *span = SPAN(address);
+    if (span->magic != SPAN_MAGIC) return;
+
+    uint64_t flags = irq_save();
+    if (span->cpu != cpu_id()) {
+        void *head = __atomic_load_n(&span->remote, __ATOMIC_RELAXED);
+        do {
+            *(void **)address = head;
+        } while (!__atomic_compare_exchange_n(&span->remote, &head, address, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        irq_restore(flags);
+        return;
+    }
+
+    heap_arena_t *arena = &_arenas[span->cpu];
+    *(void **)address = span->free;
+    span->free = address;
+    span->inuse--;
+
+    if (span->full) {
+        __remove(&arena->full[span->class], span);
+        __push(&arena->partial[span->class], span);
+        span->full = false;
+    } else if (span->inuse == 0 && (span->next != NULL || span->prev != NULL)) {
+        // nothing is outstanding, remote frees included, and the class has other spans to use
+        __remove(&arena->partial[span->class], span);
+        span->magic = 0;
+        pageframe_free(span);
+    }
+    irq_restore(flags);
+}
+
+size_t heap_arena_size(void *address)
+{
+    return CLASS_SIZE(SPAN(address)->class);
+}
+
+static heap_span_t* __create_span(heap_arena_t *arena, uint32_t cpu, unsigned int class)
+{
+    heap_span_t *span = (heap_span_t *)pageframe_request();
+    if (span == NULL) return NULL;
+    pageframe_set_owner(span, PAGEFRAME_OWNER_HEAP_ARENA);
+
+    span->magic = SPAN_MAGIC;
+    span->cpu = cpu;
+    span->class = class;
+    span->remote = NULL;
+    span->inuse = 0;
+    span->capacity = (PAGE_SIZE - SPAN_OFFSET) / CLASS_SIZE(class);
+    span->full = false;
+
+    uint8_t *object = (uint8_t *)span + SPAN_OFFSET;
+    span->free = object;
+    for (uint32_t i = 0; i + 1 < span->capacity; i++, object += CLASS_SIZE(class)) {
+        *(void **)object = object + CLASS_SIZE(class);
+    }
+    *(void **)object = NULL;
+
+    __push(&arena->partial[class], span);
+    return span;
+}
+
+static heap_span_t* __reclaim_full(heap_arena_t *arena, unsigned int class)
+{
+    for (heap_span_t *span = arena->full[class]; span != NULL; span = span->next) {
+        if (__atomic_load_n(&span->remote, __ATOMIC_RELAXED) == NULL) continue;
+
+        __collect(span);
+        __remove(&arena->full[class], span);
+        __push(&arena->partial[class], span);
+        span->full = false;
+        return span;
+    }
+    return NULL;
+}
+
+// moves everything other CPUs freed on to the owner's free list
+static void __collect(heap_span_t *span)
+{
+    void *remote = __atomic_exchange_n(&span->remote, NULL, __ATOMIC_ACQUIRE);
+    if (remote == NULL) return;
+
+    void *tail = remote;
+    uint32_t count = 1;
+    while (*(void **)tail != NULL) {
+        tail = *(void **)tail;
+        count++;
+    }
+
+    *(void **)tail = span->free;
+    span->free = remote;
+    span->inuse -= count;
+}
+
+static void __push(heap_span_t **list, heap_span_t *span)
+{
+    span->prev = NULL;
+    span->next = *list;
+    if (span->next != NULL) span->next->prev = span;
+    *list = span;
+}
+
+static void __remove(heap_span_t **list, heap_span_t *span)
+{
+    if (span->prev != NULL) span->prev->next = span->next;
+    else *list = span->next;
+    if (span->next != NULL) span->next->prev = span->prev;
+    span->next = NULL;
+    span->prev = NULL;
+}
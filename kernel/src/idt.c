@@ -1,15 +1,13 @@
 #include "idt.h"
 #include "interrupt_handlers.h"
-#include "pageframe_allocator.h"
-#include "string.h"
+#include "memblock.h"
 
 idt_descriptor_t _idtr;
 
 void idt_init()
 {
     _idtr.limit = (sizeof(idt_entry_t) * MAX_NUM_IDT_ENTRIES) - 1;
-    _idtr.base = (uint64_t)pageframe_request();
-    memzero((void *)_idtr.base, _idtr.limit);
+    _idtr.base = (uint64_t)memblock_alloc(_idtr.limit + 1);
 
     set_idt_gate(int_handler_pagefault, 0xE, 0x08, IDT_FLAGS_INTERRUPT_GATE);
     set_idt_gate(int_handler_double_fault, 0x08, 0x08, IDT_FLAGS_INTERRUPT_GATE);
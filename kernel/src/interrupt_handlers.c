@@ -12,10 +12,19 @@
 #include "ps2_mouse.h"
 #include "pit.h"
 #include "string.h"
+#include "stdio.h"
+#include "cpu.h"
+#include "demand.h"
+#include "sections.h"
 
-__attribute__((interrupt)) void int_handler_pagefault(struct interrupt_frame *frame)
+// the cpu pushes an error code for page faults, the handler has to take it for iretq to find the frame
+__attribute__((interrupt)) HOT_TEXT void int_handler_pagefault(struct interrupt_frame *frame, uint64_t error_code)
 {
+    void *address = (void *)read_cr2();
+    if (demand_fault(address, error_code)) return;
+
     panic("page fault detected");
+    printf("\naddress: %x, error: %x", (uint64_t)address, error_code);
     while(true);
 }
 
@@ -31,21 +40,21 @@ __attribute__((interrupt)) void int_handler_general_protection(struct interrupt_
     while(true);
 }
 
-__attribute__((interrupt)) void int_handler_keyboard(struct interrupt_frame *frame)
+__attribute__((interrupt)) HOT_TEXT void int_handler_keyboard(struct interrupt_frame *frame)
 {
     uint8_t scancode = inb(0x60); // ps/2 keyboard port
     kbd_handle_input(scancode);
     pic_eoi(IRQ_KBD_PS2);
 }
 
-__attribute__((interrupt)) void int_handler_mouse(struct interrupt_frame *frame)
+__attribute__((interrupt)) HOT_TEXT void int_handler_mouse(struct interrupt_frame *frame)
 {
     uint8_t data = ps2_mouse_read();
     ps2_mouse_process_input(data);
     pic_eoi(IRQ_MOUSE_PS2);
 }
 
-__attribute__((interrupt)) void int_handler_pit(struct interrupt_frame *frame)
+__attribute__((interrupt)) HOT_TEXT void int_handler_pit(struct interrupt_frame *frame)
 {
     pit_tick();
     pic_eoi(IRQ_SYSTEM_TIMER);
@@ -1,6 +1,7 @@
 #include "kernel.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include "types.h"
 #include "globals.h"
@@ -21,12 +22,24 @@
 #include "pci.h"
 #include "heap.h"
 #include "pit.h"
+#include "percpu.h"
+#include "demand.h"
+#include "ahci.h"
+#include "swap.h"
+#include "vmap.h"
+#include "memblock.h"
 
+#define SWAP_PAGES 0x4000   // 64 MiB at most, whatever the size of the swap partition
+#define BOOT_STACK_SIZE 0x4000
+
+void kernel_main(boot_info_t *boot_info);
 void initialize_kernel(boot_info_t *boot_info);
 void setup_terminal(boot_info_t *boot_info);
 void setup_paging(boot_info_t *boot_info);
 void setup_interrupts(void);
 void setup_acpi(boot_info_t *boot_info);
+void reclaim_boot_memory(boot_info_t *boot_info);
+void setup_swap(void);
 void display_banner(boot_info_t *boot_info);
 void loop();
 
@@ -35,7 +48,24 @@ pml4_t *g_pml4 = NULL;
 tty_t tty;
 tty_t *g_tty = &tty;
 
+static memory_info_t _memory_info;
+static psf1_header_t _font_header;
+static psf1_font_t _font;
+static rsdp_descriptor_t _rsdp;
+static const char *_acpi_tables[] = { "MCFG" };    // kept past the reclaim of ACPI memory
+static uint64_t _reclaimed;
+static uint8_t _boot_stack[BOOT_STACK_SIZE] __attribute__((aligned(16)));
+
+// the loader's stack is only mapped by its own tables, the kernel moves to one in the image before
+// pagetable_init leaves the lower half empty. entered as if called, so rsp + 8 is 16 byte aligned
 void _start(boot_info_t *boot_info)
+{
+    asm volatile ( "mov {%0, %%rsp | rsp, %0}\n\tjmp {*%1 | %1}"
+                   : : "r"((uint64_t)_boot_stack + BOOT_STACK_SIZE - 8), "r"(kernel_main), "D"(boot_info) : "memory" );
+    __builtin_unreachable();
+}
+
+void kernel_main(boot_info_t *boot_info)
 {
     initialize_kernel(boot_info);
     display_banner(boot_info);
@@ -46,12 +76,16 @@ void _start(boot_info_t *boot_info)
 void initialize_kernel(boot_info_t *boot_info)
 {
     setup_terminal(boot_info);
-    setup_paging(boot_info);
-    heap_init((void *)0x0000100000000000, 0x10);
     gdt_init();
+    percpu_init(0); // after gdt_init, reloading gs clears its base
+    setup_paging(boot_info);
+    vmap_init();
+    heap_init(vmap_reserve(HEAP_WINDOW_SIZE / PAGE_SIZE), 0x10);
     setup_interrupts();
     ps2_mouse_init();
     setup_acpi(boot_info);
+    reclaim_boot_memory(boot_info); // after anything that walks the ACPI tables
+    setup_swap();
     pit_init(100); // 100hz == 100 ticks / second
 
     outb(PIC1_DATA, 0b11111000);  // unmask PIT (IRQ0), keyboard (IRQ1) and cascade (IRQ2)
@@ -64,40 +98,93 @@ void setup_terminal(boot_info_t *boot_info)
     tty_init(g_tty, boot_info->framebuffer, boot_info->font);
 }
 
+// the page tables and the IDT come from memblock, which the frame allocator then takes over from
 void setup_paging(boot_info_t *boot_info)
 {
     memory_info_t *memory_info = boot_info->memory_info;
-    pageframe_allocator_init(memory_info);
-    g_pml4 = (pml4_t *)pageframe_request();
+    memblock_init(memory_info);
+    g_pml4 = (pml4_t *)memblock_alloc(PAGE_SIZE);
     pagetable_init(g_pml4, boot_info);
+    idt_init();
+    pageframe_allocator_init(memory_info);
 }
 
 void setup_interrupts()
 {
-    idt_init();
     pic_remap(0x20, 0x28);
 }
 
 void setup_acpi(boot_info_t *boot_info)
 {
-    acpi_sdt_header_t *xsdt = (acpi_sdt_header_t *)(boot_info->rootSystemDescriptionPointer->xsdt_address);
+    acpi_sdt_header_t *xsdt = (acpi_sdt_header_t *)phys_to_virt(boot_info->rootSystemDescriptionPointer->xsdt_address);
     acpi_mcfg_header_t *mcfg = (acpi_mcfg_header_t *)acpi_find_table(xsdt, (char *)"MCFG");
 
     pci_enumerate(mcfg);
 }
 
+void reclaim_boot_memory(boot_info_t *boot_info)
+{
+    memory_info_t *memory_info = boot_info->memory_info;
+    _memory_info = *memory_info;
+    _memory_info.memory_map = (efi_memory_descriptor_t *)heap_alloc(memory_info->memory_map_size);
+    memcpy(_memory_info.memory_map, memory_info->memory_map, memory_info->memory_map_size);
+    boot_info->memory_info = &_memory_info;
+
+    psf1_font_t *font = boot_info->font;
+    size_t glyph_count = font->header->mode == 1 ? 512 : 256;
+    size_t glyph_buffer_size = font->header->char_size * glyph_count;
+    _font_header = *font->header;
+    _font.header = &_font_header;
+    _font.glyph_buffer = heap_alloc(glyph_buffer_size);
+    memcpy(_font.glyph_buffer, font->glyph_buffer, glyph_buffer_size);
+    boot_info->font = &_font;
+    g_tty->font = &_font;
+
+    // the RSDP is repointed at copies of the XSDT and of the tables still used, ACPI memory is only
+    // handed back once they are out of it
+    _rsdp = *boot_info->rootSystemDescriptionPointer;
+    boot_info->rootSystemDescriptionPointer = &_rsdp;
+    bool acpi = acpi_copy_tables(&_rsdp, _acpi_tables, sizeof(_acpi_tables) / sizeof(_acpi_tables[0]));
+
+    // boot_info itself lives on the loader's stack, reached through the direct map
+    _reclaimed = pageframe_reclaim(&_memory_info, boot_info, acpi);
+}
+
+// swap only goes on a partition typed for it, the first one found on any SATA disk. demand_evict is not
+// handed to the frame allocator yet, the heap is the only demand region and it is never evicted
+void setup_swap(void)
+{
+    for (uint8_t i = 0; i < ahci_port_count(); i++) {
+        ahci_port_t *port = ahci_port(i);
+        if (port == NULL || port->type != AHCI_DEVICE_TYPE_SATA) continue;
+
+        uint64_t sector, slots;
+        if (!swap_find(port, &sector, &slots)) continue;
+        swap_init(port, sector, slots < SWAP_PAGES ? slots : SWAP_PAGES);
+        return;
+    }
+}
+
 void display_banner(boot_info_t *boot_info)
 {
     printf("Welcome to theOS!!\n");
     printf("Memory Free: %u\n", (pageframe_memory_free() / 1024));
     printf("Memory Used: %u\n", (pageframe_memory_used() / 1024));
     printf("Memory Rsvd: %u\n", (pageframe_memory_used() / 1024));
+    printf("Reclaimed:   %u MiB\n", _reclaimed / (1024 * 1024));
+    printf("Frame Init:  %u cycles\n", pageframe_init_cycles());
+    printf("Frame Cache: %u hits, %u misses\n", pageframe_magazine_hits(), pageframe_magazine_misses());
+    printf("Zero Pool:   %u hits, %u misses\n", pageframe_zeroed_hits(), pageframe_zeroed_misses());
+    printf("Heap Alloc:  %u cycles worst\n", heap_alloc_worst_cycles());
+    printf("Heap Faults: %u pages, %u copied on write\n", demand_faults(), demand_cow_copies());
+    printf("Swap Used:   %u pages, %u swapped in\n", swap_slots_used(), demand_swap_ins());
 }
 
 void loop()
 {
     while(true) {
         ps2_mouse_handle_input();
-        asm("hlt");
+        // only sleep once there is nothing left to zero
+        if (pageframe_zero_idle() == 0) asm("hlt");
     }
 }
\ No newline at end of file
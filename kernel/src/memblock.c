@@ -0,0 +1,143 @@
+#include "memblock.h"
+
+#include <string.h>
+
+#include "paging.h"
+#include "sections.h"
+
+#define LOW_MEMORY_END 0x100000                 // left to firmware and legacy devices, as by the frame allocator
+#define PAGE_UP(size) (((size) + PAGE_SIZE - 1) & PAGE_MASK)
+#define DESCRIPTOR(info, i) ((efi_memory_descriptor_t *)((uint64_t)(info)->memory_map + ((i) * (info)->memory_map_descriptor_size)))
+
+// boot's allocator for before the frame allocator exists, handing out conventional memory from the top
+// of each range down. everything it hands out or is told about stays in _reserved, which the frame
+// allocator takes over as in use before memblock_retire ends it
+static memblock_range_t _memory[MEMBLOCK_MAX_RANGES];
+static size_t _memory_count;
+static memblock_range_t _reserved[MEMBLOCK_MAX_RANGES];
+static size_t _reserved_count;
+static bool _active;
+
+// private functions
+static bool __insert(memblock_range_t *ranges, size_t *count, uint64_t base, uint64_t size);
+static const memblock_range_t* __overlap(uint64_t base, uint64_t size);
+
+void memblock_init(memory_info_t *memory_info)
+{
+    uint64_t entries = memory_info->memory_map_size / memory_info->memory_map_descriptor_size;
+    for (uint64_t i = 0; i < entries; i++) {
+        efi_memory_descriptor_t *desc = DESCRIPTOR(memory_info, i);
+        if (desc->type != EFI_CONVENTIONAL_MEMORY_TYPE_INDEX) continue;
+
+        uint64_t base = (uint64_t)desc->physical_address;
+        uint64_t end = base + (desc->page_count * PAGE_SIZE);
+        if (end <= LOW_MEMORY_END) continue;
+        if (base < LOW_MEMORY_END) base = LOW_MEMORY_END;
+        __insert(_memory, &_memory_count, base, end - base);
+    }
+    _active = true;
+
+    // neither is conventional memory when the loader does its job, but nothing may be handed out over them
+    memblock_reserve(virt_to_phys(&_TextStart), (uint64_t)&_BssEnd - (uint64_t)&_TextStart);
+    memblock_reserve(virt_to_phys(memory_info->memory_map), memory_info->memory_map_size);
+}
+
+// keeps the range from being handed out, false when the table is full
+bool memblock_reserve(uint64_t base, uint64_t size)
+{
+    uint64_t end = PAGE_UP(base + size);
+    base &= PAGE_MASK;
+    return __insert(_reserved, &_reserved_count, base, end - base);
+}
+
+// zeroed, page aligned memory at its direct map address. NULL once retired or when nothing fits
+void* memblock_alloc(size_t size)
+{
+    if (!_active || size == 0) return NULL;
+    size = PAGE_UP(size);
+
+    for (size_t i = _memory_count; i-- > 0;) {
+        uint64_t end = _memory[i].base + _memory[i].size;
+        while (end - _memory[i].base >= size) {
+            const memblock_range_t *reserved = __overlap(end - size, size);
+            if (reserved == NULL) break;
+            end = reserved->base;
+            if (end < _memory[i].base) end = _memory[i].base;
+        }
+        if (end - _memory[i].base < size) continue;
+
+        uint64_t base = end - size;
+        if (!memblock_reserve(base, size)) return NULL;
+        if (end == _memory[i].base + _memory[i].size) _memory[i].size -= size; // the bump
+
+        void *address = phys_to_virt(base);
+        memzero(address, size);
+        return address;
+    }
+    return NULL;
+}
+
+bool memblock_active(void)
+{
+    return _active;
+}
+
+// the ranges in use, in address order, for the frame allocator to take over
+size_t memblock_reserved(const memblock_range_t **ranges)
+{
+    *ranges = _reserved;
+    return _reserved_count;
+}
+
+// from here on memblock_alloc fails, allocations go to the frame allocator
+void memblock_retire(void)
+{
+    _active = false;
+}
+
+// inserts in address order, merging with any range it touches or overlaps
+static bool __insert(memblock_range_t *ranges, size_t *count, uint64_t base, uint64_t size)
+{
+    if (size == 0) return true;
+    uint64_t end = base + size;
+
+    size_t index = 0;
+    while (index < *count && ranges[index].base + ranges[index].size < base) index++;
+
+    if (index < *count && ranges[index].base <= end) {
+        memblock_range_t *range = &ranges[index];
+        uint64_t range_end = range->base + range->size;
+        if (base < range->base) range->base = base;
+        if (end > range_end) range_end = end;
+
+        // the grown range may now reach the ones after it
+        while (index + 1 < *count && ranges[index + 1].base <= range_end) {
+            uint64_t next_end = ranges[index + 1].base + ranges[index + 1].size;
+            if (next_end > range_end) range_end = next_end;
+            for (size_t i = index + 1; i + 1 < *count; i++) {
+                ranges[i] = ranges[i + 1];
+            }
+            (*count)--;
+        }
+        range->size = range_end - range->base;
+        return true;
+    }
+
+    if (*count == MEMBLOCK_MAX_RANGES) return false;
+    for (size_t i = *count; i > index; i--) {
+        ranges[i] = ranges[i - 1];
+    }
+    ranges[index].base = base;
+    ranges[index].size = size;
+    (*count)++;
+    return true;
+}
+
+// the highest reserved range overlapping the one given, NULL when it is free
+static const memblock_range_t* __overlap(uint64_t base, uint64_t size)
+{
+    for (size_t i = _reserved_count; i-- > 0;) {
+        if (_reserved[i].base < base + size && _reserved[i].base + _reserved[i].size > base) return &_reserved[i];
+    }
+    return NULL;
+}
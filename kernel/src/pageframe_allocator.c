@@ -1,81 +1,164 @@
 #include "pageframe_allocator.h"
 #include <stddef.h>
+#include <string.h>
 
-#define PAGE(address) ((uint64_t)address / PAGE_SIZE)
-#define ADDRESS(index) ((void *)(i * PAGE_SIZE))
+#include "cpu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "memblock.h"
+#include "sections.h"
+
+#define PAGE(address) (virt_to_phys((void *)(address)) / PAGE_SIZE)
+#define ADDRESS(index) phys_to_virt((index) * PAGE_SIZE)
+#define DESCRIPTOR(info, i) ((efi_memory_descriptor_t *)((uint64_t)(info)->memory_map + ((i) * (info)->memory_map_descriptor_size)))
+
+#define MAX_REGIONS 128
+#define LOW_MEMORY_FRAMES 0x100                 // first 1 MiB is left to firmware and legacy devices
+#define DMA32_LIMIT_FRAMES 0x100000             // frames below 4 GiB
+#define DMA32_WATERMARK_MAX 0x1000              // at most 16 MiB of DMA32 is held back from fallback
+
+#define MAGAZINE_SIZE 64
+#define MAGAZINE_BATCH_ORDER 5
+#define MAGAZINE_BATCH (1UL << MAGAZINE_BATCH_ORDER)
+#define ZERO_POOL_SIZE 256                      // frames kept zeroed ahead of time, 1 MiB
+#define ZERO_IDLE_BATCH 16                      // frames zeroed per pass of the idle loop
+#define ZERO_RESERVE_FRAMES 0x1000              // the pool stops growing when free memory drops below this
+
+typedef struct {
+    uint64_t base;                              // first frame in the region
+    uint64_t frames;
+    PAGEFRAME_ZONE zone;
+    bitmap_t bitmap;                            // one bit per frame from base, set while the frame is in use
+    buddy_t buddy;
+    pageframe_desc_t *descs;                    // the page database, one descriptor per frame from base
+} pageframe_region_t;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t free;
+    uint64_t watermark;                         // free frames kept back from allocations falling back from a higher zone
+} pageframe_zone_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+    void *frames[MAGAZINE_SIZE];
+} pageframe_magazine_t;
 
 static uint64_t _memory_free;
 static uint64_t _memory_reserved;
 static uint64_t _memory_used;
 static bool _initialized;
-static bitmap_t _bitmap;
-static uint64_t _bitmap_index;
+static pageframe_region_t _regions[MAX_REGIONS];
+static uint64_t _region_count;
+static pageframe_zone_t _zones[PAGEFRAME_ZONE_COUNT];
+static uint64_t _init_cycles;
+static spinlock_t _lock = SPINLOCK_INIT;
+static pageframe_magazine_t _magazines[MAX_CPUS];
+static void *_zeroed[ZERO_POOL_SIZE];
+static uint64_t _zeroed_count;
+static uint64_t _zeroed_hits;
+static uint64_t _zeroed_misses;
+static spinlock_t _zero_lock = SPINLOCK_INIT;
+static pageframe_reclaim_t _reclaim;
 
-extern uint64_t _KernelStart;
-extern uint64_t _KernelEnd;
 
 // private functions
-static void __reserve_page(void *address);
-static void __reserve_pages(void *address, size_t page_count);
-static void __unreserve_page(void *address);
-static void __unreserve_pages(void *address, size_t page_count);
+static void __build_regions(memory_info_t *memory_info);
+static void __add_region(uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone);
+static pageframe_region_t* __insert_region(uint64_t index, uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone);
+static bool __is_reclaimable(uint32_t type, bool acpi);
+static uint64_t __reclaim_run(uint64_t base, uint64_t end);
+static uint64_t __reclaim_region(uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone);
+static void __init_region_metadata(void);
+static pageframe_region_t* __find_region(uint64_t frame);
+static uint64_t __lock_range(uint64_t frame, uint64_t count);
+static void __populate_buddy(pageframe_region_t *region);
+static uint64_t __alloc_locked(unsigned int order, PAGEFRAME_ZONE zone);
+static uint64_t __alloc_zone_locked(unsigned int order, PAGEFRAME_ZONE zone);
+static void __free_locked(uint64_t frame, unsigned int order);
+static void __refill(pageframe_magazine_t *magazine);
+static void __drain(pageframe_magazine_t *magazine);
+static uint64_t __magazine_frames(void);
+static void* __pool_pop(void);
+static void __zero_frame(void *frame);
 
 void pageframe_allocator_init(memory_info_t *memory_info)
 {
     if (_initialized) return;
+    uint64_t init_start = rdtsc();
 
-    uint64_t entries = memory_info->memory_map_size / memory_info->memory_map_descriptor_size;
-    void *largest_free_seg = NULL;
-    size_t largest_free_size = 0;
-
-    for (int i = 0; i < entries; i++) {
-        efi_memory_descriptor_t *desc = (efi_memory_descriptor_t *)((uint64_t)memory_info->memory_map + (i * memory_info->memory_map_descriptor_size));
-        if (desc->type == EFI_CONVENTIONAL_MEMORY_TYPE_INDEX) {
-            size_t size = desc->page_count * PAGE_SIZE;
-            if (size > largest_free_size) {
-                largest_free_seg = desc->physical_address;
-                largest_free_size = size;
-            }
-        }
-    }
+    __build_regions(memory_info);
 
-    uint64_t total_system_memory = system_memory_size(memory_info);
-    _memory_free = total_system_memory;
+    uint64_t usable_frames = 0;
+    for (uint64_t i = 0; i < _region_count; i++) {
+        usable_frames += _regions[i].frames;
+        _zones[_regions[i].zone].frames += _regions[i].frames;
+    }
+    _memory_free = usable_frames * PAGE_SIZE;
 
-    uint64_t bitmap_size = (total_system_memory / PAGE_SIZE / 8) + 1;
-    bitmap_init(&_bitmap, bitmap_size, largest_free_seg);
-    _bitmap_index = (uint64_t)largest_free_seg / PAGE_SIZE;
+    _zones[ZONE_DMA32].watermark = _zones[ZONE_DMA32].frames / 32;
+    if (_zones[ZONE_DMA32].watermark > DMA32_WATERMARK_MAX) _zones[ZONE_DMA32].watermark = DMA32_WATERMARK_MAX;
 
-    __reserve_pages(0, (total_system_memory / PAGE_SIZE) + 1);
-    for (int i=0; i < entries; i++) {
-        efi_memory_descriptor_t *desc = (efi_memory_descriptor_t *)((uint64_t)memory_info->memory_map + (i * memory_info->memory_map_descriptor_size));
-        if (desc->type == EFI_CONVENTIONAL_MEMORY_TYPE_INDEX) {
-            __unreserve_pages(desc->physical_address, desc->page_count);
-        }
+    // everything the firmware describes as memory, minus MMIO, that the allocator does not manage
+    uint64_t entries = memory_info->memory_map_size / memory_info->memory_map_descriptor_size;
+    for (uint64_t i = 0; i < entries; i++) {
+        efi_memory_descriptor_t *desc = DESCRIPTOR(memory_info, i);
+        if (desc->type == EFI_MMIO_TYPE_INDEX || desc->type == EFI_MMIO_PORT_SPACE_TYPE_INDEX) continue;
+        _memory_reserved += desc->page_count * PAGE_SIZE;
     }
-    __reserve_pages(0, 0x100);
+    _memory_reserved -= usable_frames * PAGE_SIZE;
+
+    __init_region_metadata();
 
-    // lock kernel pages
-    uint64_t kernel_size = (uint64_t)&_KernelEnd - (uint64_t)&_KernelStart;
-    uint64_t kernel_page_count = ((uint64_t)kernel_size / PAGE_SIZE) + 1;
-    pageframe_nlock(&_KernelStart, kernel_page_count);
+    // everything memblock handed out or kept back, the metadata above, the boot page tables, the IDT and
+    // the kernel image, stays in use. after this boot allocations come from here
+    const memblock_range_t *reserved;
+    size_t reserved_count = memblock_reserved(&reserved);
+    for (size_t i = 0; i < reserved_count; i++) {
+        pageframe_nlock(phys_to_virt(reserved[i].base), reserved[i].size / PAGE_SIZE);
+    }
+    memblock_retire();
 
-    // lock bitmap pages
-    pageframe_nlock(_bitmap.buffer, (_bitmap.size / PAGE_SIZE) + 1);
+    // every frame still clear in a region bitmap is handed to that region's buddy allocator
+    for (uint64_t i = 0; i < _region_count; i++) {
+        __populate_buddy(&_regions[i]);
+    }
 
     _initialized = true;
+    _init_cycles = rdtsc() - init_start;
 }
 
-bool pageframe_free(void *address)
+HOT_TEXT bool pageframe_free(void *address)
 {
     uint64_t page = PAGE(address);
-    if (bitmap_check(&_bitmap, page) == false) return address;
-    if (bitmap_clear(&_bitmap, page)) {
+    pageframe_region_t *region = __find_region(page);
+    if (region == NULL || bitmap_check(&region->bitmap, page - region->base) == false) return false;
+
+    // a shared frame only loses a reference
+    pageframe_desc_t *desc = &region->descs[page - region->base];
+    if (desc->flags & PAGEFRAME_FLAG_PINNED) return true;
+    uint32_t refs = __atomic_load_n(&desc->refcount, __ATOMIC_ACQUIRE);
+    while (refs > 0 && !__atomic_compare_exchange_n(&desc->refcount, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+    if (refs > 0) return true;
+    desc->owner = PAGEFRAME_OWNER_NONE;
+
+    if (!_initialized) {
+        bitmap_clear(&region->bitmap, page - region->base);
         _memory_free += PAGE_SIZE;
         _memory_used -= PAGE_SIZE;
         return true;
     }
-    return false;
+
+    // frames parked in a magazine stay marked used in the bitmap until drained
+    uint64_t flags = irq_save();
+    pageframe_magazine_t *magazine = &_magazines[cpu_id()];
+    if (magazine->count == MAGAZINE_SIZE) __drain(magazine);
+    magazine->frames[magazine->count++] = address;
+    irq_restore(flags);
+    return true;
 }
 
 void pageframe_nfree(void *address, size_t page_count)
@@ -89,50 +172,232 @@ void pageframe_nfree(void *address, size_t page_count)
 bool pageframe_lock(void *address)
 {
     uint64_t page = PAGE(address);
-    if (bitmap_check(&_bitmap, page) == true) return address;
-    if (bitmap_set(&_bitmap, page)) {
+    pageframe_region_t *region = __find_region(page);
+    if (region == NULL || bitmap_check(&region->bitmap, page - region->base) == true) return false;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    bool locked = bitmap_set(&region->bitmap, page - region->base);
+    if (locked) {
+        if (_initialized && buddy_reserve(&region->buddy, page)) _zones[region->zone].free--;
         _memory_free -= PAGE_SIZE;
         _memory_used += PAGE_SIZE;
-        return true;
     }
-    return false;
+    spinlock_release(&_lock);
+    irq_restore(flags);
+    return locked;
 }
 
 void pageframe_nlock(void *address, size_t page_count)
 {
+    if (!_initialized) {
+        uint64_t count = __lock_range(PAGE(address), page_count);
+        _memory_free -= count * PAGE_SIZE;
+        _memory_used += count * PAGE_SIZE;
+        return;
+    }
+
     for (int i = 0; i < page_count; i++)
     {
         pageframe_lock((void *)((uint64_t)address + (i * PAGE_SIZE)));
     }
 }
 
-void* pageframe_request(void)
+HOT_TEXT void* pageframe_request(void)
+{
+    uint64_t flags = irq_save();
+    pageframe_magazine_t *magazine = &_magazines[cpu_id()];
+    if (magazine->count > 0) {
+        magazine->hits++;
+    } else {
+        magazine->misses++;
+        __refill(magazine);
+    }
+
+    void *address = magazine->count > 0 ? magazine->frames[--magazine->count] : NULL;
+    irq_restore(flags);
+
+    // zeroed frames are still free frames, give them up before failing
+    if (address == NULL) address = __pool_pop();
+
+    // then have pages swapped out, their frames land in this cpu's magazine
+    if (address == NULL && _reclaim != NULL && _reclaim(MAGAZINE_BATCH) > 0) return pageframe_request();
+    return address;
+}
+
+// the descriptor of a managed frame, NULL for memory the allocator does not manage
+pageframe_desc_t* pageframe_desc(void *address)
+{
+    uint64_t page = PAGE(address);
+    pageframe_region_t *region = __find_region(page);
+    return region != NULL ? &region->descs[page - region->base] : NULL;
+}
+
+// takes another reference to an allocated frame, each one is dropped by a pageframe_free
+void pageframe_get(void *address)
+{
+    pageframe_desc_t *desc = pageframe_desc(address);
+    if (desc != NULL) __atomic_add_fetch(&desc->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+void pageframe_set_owner(void *address, PAGEFRAME_OWNER owner)
+{
+    pageframe_desc_t *desc = pageframe_desc(address);
+    if (desc != NULL) desc->owner = owner;
+}
+
+// a last resort for when no free frames are left, returning how many of the frames asked for it freed
+void pageframe_set_reclaim(pageframe_reclaim_t reclaim)
+{
+    _reclaim = reclaim;
+}
+
+// a frame from the pre-zeroed pool, or one zeroed here when the idle loop has not kept up
+void* pageframe_request_zeroed(void)
+{
+    void *address = __pool_pop();
+
+    // the stats are bumped from every cpu, so they share the pool's lock
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_zero_lock);
+    if (address != NULL) _zeroed_hits++;
+    else _zeroed_misses++;
+    spinlock_release(&_zero_lock);
+    irq_restore(flags);
+    if (address != NULL) return address;
+
+    address = pageframe_request();
+    if (address != NULL) memzero(address, PAGE_SIZE);
+    return address;
+}
+
+// tops up the pre-zeroed pool a batch at a time, returning how many frames were zeroed. meant for idle
+// time, interrupts stay enabled while a frame is being cleared
+uint64_t pageframe_zero_idle(void)
+{
+    uint64_t zeroed = 0;
+    while (zeroed < ZERO_IDLE_BATCH && _zeroed_count < ZERO_POOL_SIZE && _memory_free / PAGE_SIZE > ZERO_RESERVE_FRAMES) {
+        void *address = pageframe_request();
+        if (address == NULL) break;
+        __zero_frame(address);
+
+        uint64_t flags = irq_save();
+        spinlock_acquire(&_zero_lock);
+        if (_zeroed_count < ZERO_POOL_SIZE) {
+            _zeroed[_zeroed_count++] = address;
+            address = NULL;
+        }
+        spinlock_release(&_zero_lock);
+        irq_restore(flags);
+
+        if (address != NULL) {
+            pageframe_free(address);
+            break;
+        }
+        zeroed++;
+    }
+    return zeroed;
+}
+
+void* pageframe_request_n(unsigned int order)
+{
+    if (order == 0) return pageframe_request();
+    return pageframe_request_n_zone(order, ZONE_NORMAL);
+}
+
+void* pageframe_request_zone(PAGEFRAME_ZONE zone)
+{
+    return pageframe_request_n_zone(0, zone);
+}
+
+void* pageframe_request_n_zone(unsigned int order, PAGEFRAME_ZONE zone)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    uint64_t frame = __alloc_zone_locked(order, zone);
+    spinlock_release(&_lock);
+    irq_restore(flags);
+
+    return frame != BUDDY_NONE ? ADDRESS(frame) : NULL;
+}
+
+void pageframe_free_n(void *address, unsigned int order)
 {
-    for (size_t i = _bitmap_index; i < _bitmap.size * 8; i++) {
-        if (bitmap_check(&_bitmap, i) == true) continue;
-        _bitmap_index = i+1;
-        return pageframe_lock(ADDRESS(i)) ? ADDRESS(i) : NULL;
+    if (order == 0) {
+        pageframe_free(address);
+        return;
     }
 
-    if(_bitmap_index > 0) {
-        for(size_t i= 0; i < _bitmap_index; i++) {
-            if (bitmap_check(&_bitmap, i) == true) continue;
-            _bitmap_index = i+1;
-            return pageframe_lock(ADDRESS(i)) ? ADDRESS(i) : NULL;
+    uint64_t frame = PAGE(address);
+    pageframe_region_t *region = __find_region(frame);
+    if (region == NULL || bitmap_check(&region->bitmap, frame - region->base) == false) return;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    __free_locked(frame, order);
+    spinlock_release(&_lock);
+    irq_restore(flags);
+}
+
+// hands loader and boot services memory to the allocator, and ACPI reclaim memory with acpi set,
+// returning the bytes made free. everything still needed from those ranges must be copied out first;
+// the range holding keep (the stack the kernel was entered on) and the kernel image are left alone
+uint64_t pageframe_reclaim(memory_info_t *memory_info, void *keep, bool acpi)
+{
+    if (!_initialized) return 0;
+
+    uint64_t kernel_start = PAGE(&_TextStart);
+    uint64_t kernel_end = PAGE((uint64_t)&_BssEnd + PAGE_SIZE - 1);
+    uint64_t run_base = 0;
+    uint64_t run_end = 0;
+    uint64_t reclaimed = 0;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+
+    // adjacent descriptors are joined so each run costs one region and one set of metadata
+    uint64_t entries = memory_info->memory_map_size / memory_info->memory_map_descriptor_size;
+    for (uint64_t i = 0; i < entries; i++) {
+        efi_memory_descriptor_t *desc = DESCRIPTOR(memory_info, i);
+        if (!__is_reclaimable(desc->type, acpi)) continue;
+
+        uint64_t base = (uint64_t)desc->physical_address / PAGE_SIZE;
+        uint64_t end = base + desc->page_count;
+        if (PAGE(keep) >= base && PAGE(keep) < end) continue;
+
+        if (base < kernel_end && end > kernel_start) {
+            if (base < kernel_start) {
+                if (base != run_end) {
+                    reclaimed += __reclaim_run(run_base, run_end);
+                    run_base = base;
+                }
+                run_end = kernel_start;
+            }
+            if (end <= kernel_end) continue;
+            base = kernel_end;
+        }
+
+        if (base != run_end) {
+            reclaimed += __reclaim_run(run_base, run_end);
+            run_base = base;
         }
+        run_end = end;
     }
+    reclaimed += __reclaim_run(run_base, run_end);
 
-    return NULL; // perform page swap
+    spinlock_release(&_lock);
+    irq_restore(flags);
+    return reclaimed * PAGE_SIZE;
 }
 
 uint64_t pageframe_memory_free(void)
 {
-    return _memory_free;
+    return _memory_free + ((__magazine_frames() + _zeroed_count) * PAGE_SIZE);
 }
 
 uint64_t pageframe_memory_used(void)
 {
-    return _memory_used;
+    return _memory_used - ((__magazine_frames() + _zeroed_count) * PAGE_SIZE);
 }
 
 uint64_t pageframe_memory_reserved(void)
@@ -140,36 +405,341 @@ uint64_t pageframe_memory_reserved(void)
     return _memory_reserved;
 }
 
-static void __reserve_page(void *address)
+uint64_t pageframe_zone_free(PAGEFRAME_ZONE zone)
 {
-    uint64_t page = PAGE(address);
-    if (bitmap_check(&_bitmap, page) == true) return;
-    bitmap_set(&_bitmap, page);
-    _memory_free -= PAGE_SIZE;
-    _memory_reserved += PAGE_SIZE;
+    return _zones[zone].free * PAGE_SIZE;
 }
 
-static void __reserve_pages(void *address, size_t page_count)
+uint64_t pageframe_init_cycles(void)
 {
-    for (int i = 0; i < page_count; i++)
-    {
-        __reserve_page((void *)((uint64_t)address + (i * PAGE_SIZE)));
+    return _init_cycles;
+}
+
+uint64_t pageframe_magazine_hits(void)
+{
+    uint64_t hits = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        hits += _magazines[i].hits;
     }
+    return hits;
 }
 
-static void __unreserve_page(void *address)
+uint64_t pageframe_magazine_misses(void)
 {
-    uint64_t page = PAGE(address);
-    if (bitmap_check(&_bitmap, page) == false) return;
-    bitmap_clear(&_bitmap, page);
-    _memory_free += PAGE_SIZE;
-    _memory_reserved -= PAGE_SIZE;
+    uint64_t misses = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        misses += _magazines[i].misses;
+    }
+    return misses;
 }
 
-static void __unreserve_pages(void *address, size_t page_count)
+uint64_t pageframe_zeroed_hits(void)
 {
-    for (int i = 0; i < page_count; i++)
-    {
-        __unreserve_page((void *)((uint64_t)address + (i * PAGE_SIZE)));
+    return _zeroed_hits;
+}
+
+uint64_t pageframe_zeroed_misses(void)
+{
+    return _zeroed_misses;
+}
+
+static void __build_regions(memory_info_t *memory_info)
+{
+    uint64_t entries = memory_info->memory_map_size / memory_info->memory_map_descriptor_size;
+    for (uint64_t i = 0; i < entries; i++) {
+        efi_memory_descriptor_t *desc = DESCRIPTOR(memory_info, i);
+        if (desc->type != EFI_CONVENTIONAL_MEMORY_TYPE_INDEX) continue;
+
+        uint64_t base = (uint64_t)desc->physical_address / PAGE_SIZE;
+        uint64_t end = base + desc->page_count;
+        if (end <= LOW_MEMORY_FRAMES) continue;
+        if (base < LOW_MEMORY_FRAMES) base = LOW_MEMORY_FRAMES;
+
+        // a region never straddles the 4 GiB line, so each one belongs to exactly one zone
+        if (base < DMA32_LIMIT_FRAMES && end > DMA32_LIMIT_FRAMES) {
+            __add_region(base, DMA32_LIMIT_FRAMES - base, ZONE_DMA32);
+            base = DMA32_LIMIT_FRAMES;
+        }
+        __add_region(base, end - base, base < DMA32_LIMIT_FRAMES ? ZONE_DMA32 : ZONE_NORMAL);
+    }
+}
+
+// inserts in frame order, merging with any region of the same zone the new range touches or overlaps
+static void __add_region(uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone)
+{
+    uint64_t end = base + frames;
+    uint64_t index = 0;
+    while (index < _region_count && (_regions[index].base + _regions[index].frames < base ||
+            (_regions[index].base + _regions[index].frames == base && _regions[index].zone != zone)))
+        index++;
+
+    if (index < _region_count && _regions[index].base <= end && _regions[index].zone == zone) {
+        pageframe_region_t *region = &_regions[index];
+        uint64_t region_end = region->base + region->frames;
+        if (base < region->base) region->base = base;
+        if (end > region_end) region_end = end;
+        region->frames = region_end - region->base;
+
+        // the grown region may now reach the ones after it
+        while (index + 1 < _region_count && _regions[index + 1].zone == zone &&
+                _regions[index + 1].base <= region->base + region->frames) {
+            uint64_t next_end = _regions[index + 1].base + _regions[index + 1].frames;
+            if (next_end > region->base + region->frames) region->frames = next_end - region->base;
+            for (uint64_t i = index + 1; i + 1 < _region_count; i++) {
+                _regions[i] = _regions[i + 1];
+            }
+            _region_count--;
+        }
+        return;
+    }
+
+    __insert_region(index, base, frames, zone);
+}
+
+static pageframe_region_t* __insert_region(uint64_t index, uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone)
+{
+    if (_region_count == MAX_REGIONS) return NULL; // table full, the range stays unmanaged
+
+    for (uint64_t i = _region_count; i > index; i--) {
+        _regions[i] = _regions[i - 1];
+    }
+    _regions[index].base = base;
+    _regions[index].frames = frames;
+    _regions[index].zone = zone;
+    _region_count++;
+    return &_regions[index];
+}
+
+static bool __is_reclaimable(uint32_t type, bool acpi)
+{
+    return type == EFI_LOADER_DATA_TYPE_INDEX ||
+        type == EFI_BOOT_SERVICES_CODE_TYPE_INDEX ||
+        type == EFI_BOOT_SERVICES_DATA_TYPE_INDEX ||
+        (acpi && type == EFI_ACPI_RECLAIM_MEMORY_TYPE_INDEX);
+}
+
+static uint64_t __reclaim_run(uint64_t base, uint64_t end)
+{
+    if (end <= LOW_MEMORY_FRAMES) return 0;
+    if (base < LOW_MEMORY_FRAMES) base = LOW_MEMORY_FRAMES;
+
+    uint64_t reclaimed = 0;
+    if (base < DMA32_LIMIT_FRAMES && end > DMA32_LIMIT_FRAMES) {
+        reclaimed += __reclaim_region(base, DMA32_LIMIT_FRAMES - base, ZONE_DMA32);
+        base = DMA32_LIMIT_FRAMES;
+    }
+    return reclaimed + __reclaim_region(base, end - base, base < DMA32_LIMIT_FRAMES ? ZONE_DMA32 : ZONE_NORMAL);
+}
+
+// adds a region after init, its metadata taken from the start of the range itself. it is never merged
+// with a neighbour since that neighbour's metadata was sized for the frames it already has
+static uint64_t __reclaim_region(uint64_t base, uint64_t frames, PAGEFRAME_ZONE zone)
+{
+    size_t bitmap_size = (frames / 8) + 1;
+    size_t metadata_size = bitmap_buffer_size(bitmap_size) + buddy_metadata_size(base, frames) + (frames * sizeof(pageframe_desc_t));
+    uint64_t metadata_frames = (metadata_size / PAGE_SIZE) + 1;
+    if (frames <= metadata_frames) return 0;
+
+    uint64_t index = 0;
+    while (index < _region_count && _regions[index].base < base) index++;
+
+    pageframe_region_t *region = __insert_region(index, base, frames, zone);
+    if (region == NULL) return 0;
+
+    uint8_t *buffer = (uint8_t *)ADDRESS(base);
+    bitmap_init(&region->bitmap, bitmap_size, buffer);
+    buddy_init(&region->buddy, base, frames, buffer + bitmap_buffer_size(bitmap_size));
+    region->descs = (pageframe_desc_t *)(buffer + bitmap_buffer_size(bitmap_size) + buddy_metadata_size(base, frames));
+    memzero(region->descs, frames * sizeof(pageframe_desc_t));
+
+    bitmap_set_range(&region->bitmap, 0, metadata_frames);
+    buddy_free_range(&region->buddy, base + metadata_frames, frames - metadata_frames);
+
+    _zones[zone].frames += frames;
+    _zones[zone].free += frames - metadata_frames;
+    _memory_reserved -= frames * PAGE_SIZE;
+    _memory_free += (frames - metadata_frames) * PAGE_SIZE;
+    _memory_used += metadata_frames * PAGE_SIZE;
+    return frames - metadata_frames;
+}
+
+// every region's bitmap, buddy maps and page database in one block from memblock, which comes zeroed
+// and is locked with the rest of memblock's ranges. without it nothing is managed
+static void __init_region_metadata(void)
+{
+    if (_region_count == 0) return;
+
+    size_t total = 0;
+    for (uint64_t i = 0; i < _region_count; i++) {
+        pageframe_region_t *region = &_regions[i];
+        total += bitmap_buffer_size((region->frames / 8) + 1);
+        total += buddy_metadata_size(region->base, region->frames);
+        total += region->frames * sizeof(pageframe_desc_t);
+    }
+
+    uint8_t *buffer = (uint8_t *)memblock_alloc(total);
+    if (buffer == NULL) {
+        _region_count = 0;
+        return;
+    }
+    for (uint64_t i = 0; i < _region_count; i++) {
+        pageframe_region_t *region = &_regions[i];
+        size_t bitmap_size = (region->frames / 8) + 1;
+        bitmap_init(&region->bitmap, bitmap_size, buffer);
+        buffer += bitmap_buffer_size(bitmap_size);
+
+        buddy_init(&region->buddy, region->base, region->frames, buffer);
+        buffer += buddy_metadata_size(region->base, region->frames);
+
+        region->descs = (pageframe_desc_t *)buffer;
+        buffer += region->frames * sizeof(pageframe_desc_t);
+    }
+}
+
+static pageframe_region_t* __find_region(uint64_t frame)
+{
+    uint64_t low = 0;
+    uint64_t high = _region_count;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        pageframe_region_t *region = &_regions[mid];
+        if (frame < region->base) high = mid;
+        else if (frame >= region->base + region->frames) low = mid + 1;
+        else return region;
+    }
+    return NULL;
+}
+
+// marks the frames of every region overlapping the range as used, returning how many changed
+static uint64_t __lock_range(uint64_t frame, uint64_t count)
+{
+    uint64_t end = frame + count;
+    uint64_t changed = 0;
+    for (uint64_t i = 0; i < _region_count; i++) {
+        pageframe_region_t *region = &_regions[i];
+        uint64_t start = frame > region->base ? frame : region->base;
+        uint64_t stop = end < region->base + region->frames ? end : region->base + region->frames;
+        if (start >= stop) continue;
+        changed += bitmap_set_range(&region->bitmap, start - region->base, stop - start);
+    }
+    return changed;
+}
+
+static void __populate_buddy(pageframe_region_t *region)
+{
+    uint64_t run_start = bitmap_find_first_zero(&region->bitmap, 0);
+
+    while (run_start < region->frames) {
+        uint64_t run_end = bitmap_find_first_set(&region->bitmap, run_start);
+        if (run_end > region->frames) run_end = region->frames;
+
+        buddy_free_range(&region->buddy, region->base + run_start, run_end - run_start);
+        if (run_end == region->frames) break;
+        run_start = bitmap_find_first_zero(&region->bitmap, run_end);
+    }
+
+    _zones[region->zone].free += region->buddy.free;
+}
+
+static uint64_t __alloc_locked(unsigned int order, PAGEFRAME_ZONE zone)
+{
+    for (uint64_t i = 0; i < _region_count; i++) {
+        pageframe_region_t *region = &_regions[i];
+        if (region->zone != zone) continue;
+
+        uint64_t frame = buddy_alloc(&region->buddy, order);
+        if (frame == BUDDY_NONE) continue;
+
+        uint64_t count = bitmap_set_range(&region->bitmap, frame - region->base, 1UL << order);
+        _zones[zone].free -= 1UL << order;
+        _memory_free -= count * PAGE_SIZE;
+        _memory_used += count * PAGE_SIZE;
+        return frame;
+    }
+    return BUDDY_NONE;
+}
+
+// tries the requested zone first, then lower zones as long as they stay above their watermark. a zone
+// with no memory at all, ZONE_NORMAL below 4 GiB, has nothing to hold the lower ones back for
+static uint64_t __alloc_zone_locked(unsigned int order, PAGEFRAME_ZONE zone)
+{
+    uint64_t frame = __alloc_locked(order, zone);
+    bool reserve = _zones[zone].frames > 0;
+    for (int fallback = (int)zone - 1; frame == BUDDY_NONE && fallback >= 0; fallback--) {
+        pageframe_zone_t *lower = &_zones[fallback];
+        if (reserve && lower->free < lower->watermark + (1UL << order)) continue;
+        frame = __alloc_locked(order, (PAGEFRAME_ZONE)fallback);
+    }
+    return frame;
+}
+
+static void __free_locked(uint64_t frame, unsigned int order)
+{
+    pageframe_region_t *region = __find_region(frame);
+    if (region == NULL) return;
+
+    uint64_t count = bitmap_clear_range(&region->bitmap, frame - region->base, 1UL << order);
+    _zones[region->zone].free += 1UL << order;
+    _memory_free += count * PAGE_SIZE;
+    _memory_used -= count * PAGE_SIZE;
+    buddy_free(&region->buddy, frame, order);
+}
+
+static void __refill(pageframe_magazine_t *magazine)
+{
+    spinlock_acquire(&_lock);
+
+    // one contiguous batch when possible, otherwise whatever single frames remain
+    uint64_t frame = __alloc_zone_locked(MAGAZINE_BATCH_ORDER, ZONE_NORMAL);
+    if (frame != BUDDY_NONE) {
+        for (uint64_t i = MAGAZINE_BATCH; i > 0; i--) {
+            magazine->frames[magazine->count++] = ADDRESS(frame + i - 1);
+        }
+    } else {
+        for (uint64_t i = 0; i < MAGAZINE_BATCH; i++) {
+            frame = __alloc_zone_locked(0, ZONE_NORMAL);
+            if (frame == BUDDY_NONE) break;
+            magazine->frames[magazine->count++] = ADDRESS(frame);
+        }
+    }
+
+    spinlock_release(&_lock);
+}
+
+static void __drain(pageframe_magazine_t *magazine)
+{
+    spinlock_acquire(&_lock);
+    for (uint64_t i = 0; i < MAGAZINE_BATCH && magazine->count > 0; i++) {
+        __free_locked(PAGE(magazine->frames[--magazine->count]), 0);
     }
-}
\ No newline at end of file
+    spinlock_release(&_lock);
+}
+
+static uint64_t __magazine_frames(void)
+{
+    uint64_t frames = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        frames += _magazines[i].count;
+    }
+    return frames;
+}
+
+static void* __pool_pop(void)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_zero_lock);
+    void *address = _zeroed_count > 0 ? _zeroed[--_zeroed_count] : NULL;
+    spinlock_release(&_zero_lock);
+    irq_restore(flags);
+    return address;
+}
+
+// non-temporal stores, clearing a frame for later should not evict the cache lines in use now
+static void __zero_frame(void *frame)
+{
+    uint64_t *qwords = (uint64_t *)frame;
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        asm volatile ( "movnti {%1, %0 | %0, %1}" : "=m"(qwords[i]) : "r"(0UL) );
+    }
+    asm volatile ( "sfence" : : : "memory" );
+}
@@ -2,81 +2,393 @@
 
 #include <string.h>
 
+#include "cpu.h"
+#include "memory.h"
+#include "paging.h"
+#include "sections.h"
+#include "address_space.h"
 #include "pageframe_allocator.h"
+#include "memblock.h"
+#include "panic.h"
 
 
-#define PAGE_BIT_P_PRESENT (1<<0)
-#define PAGE_BIT_RW_WRITABLE (1<<1)
-#define PAGE_BIT_US_USER (1<<2)
-#define PAGE_XD_NX (1<<63)
-#define PAGE_ADDR_MASK 0x000ffffffffff000
-#define PAGE_BIT_A_ACCESSED (1<<5)
-#define PAGE_BIT_D_DIRTY (1<<6)
+#define PAGE_SIZE_2M (1UL << 21)
+#define PAGE_SIZE_1G (1UL << 30)
 
-extern void load_pml4(struct mapping_table *pml4);
+#define LEVEL_PT 0
+#define LEVEL_PD 1
+#define LEVEL_PDPT 2
+#define LEVEL_PML4 3
+// PA0 WB, PA1 WC in place of the power-on WT, PA2 UC-, PA3 UC, PA4-7 left at their defaults
+#define PAT_VALUE 0x0007040600070106
+
+#define KERNEL_HALF_INDEX 256                   // first PML4 entry of the kernel half
+#define TABLE_INDEX(address, level) (((uint64_t)(address) >> (PAGE_SHIFT + (9 * (level)))) & 0x1FF)
+#define LEVEL_PAGES(level) (1UL << (9 * (level)))   // 4 KiB pages spanned by one entry at level
+#define TABLE_FLAGS PAGE_BIT_RW_WRITABLE
+#define CACHE_BITS(cache) ((((cache) & 1) ? PAGE_BIT_PWT_WRITE_THROUGH : 0) | (((cache) & 2) ? PAGE_BIT_PCD_CACHE_DISABLE : 0))
+#define PROTECT_MASK (PAGE_BIT_RW_WRITABLE | PAGE_BIT_US_USER | PAGE_XD_NX)
+
+extern void load_pml4(uint64_t pml4);
+
+static bool _huge_1g = false;
+static bool _nx = false;
+
+// private functions
+static bool __walk(pml4_t *pml4, uint64_t address, int level, mapping_table_t **table);
+static uint64_t* __find_entry(pml4_t *pml4, uint64_t address, int *level);
+static void __free_tables(void **tables, size_t count, tlb_batch_t *batch);
+static bool __map_huge_range(pml4_t *pml4, uint64_t address, uint64_t physical, size_t page_count, uint64_t flags, PAGE_CACHE_TYPE cache);
+static bool __map_huge(pml4_t *pml4, uint64_t address, uint64_t physical, int level, uint64_t flags, PAGE_CACHE_TYPE cache, bool *mapped);
+static bool __map_section(pml4_t *pml4, void *start, void *end, uint64_t flags);
+static bool __update_range(pml4_t *pml4, uint64_t address, size_t page_count, uint64_t mask, uint64_t value, tlb_batch_t *batch);
+static void __update_entry(uint64_t *entry, uint64_t address, uint64_t mask, uint64_t value, tlb_batch_t *batch);
 
 void pagetable_init(pml4_t *pml4, boot_info_t *boot_info)
 {
     memzero((void *)pml4, PAGE_SIZE);
 
-    memory_info_t *memory_info = boot_info->memory_info;
+    // before any entry selects PA1, the new tables take effect with the CR3 load below
+    uint32_t eax, ebx, ecx, edx;
+    cpuid_regs(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_EDX_PAT) wrmsr(MSR_PAT, PAT_VALUE);
 
-    //identity mapping
-    uint64_t memory_size = system_memory_size(memory_info); //67108864;
-    pagetable_identity_map(pml4, (void *)0, memory_size / PAGE_SIZE + 1);
+    cpuid(CPUID_EXT_MAX, &eax, &edx);
+    if (eax >= CPUID_EXT_FEATURES) {
+        cpuid(CPUID_EXT_FEATURES, &eax, &edx);
+        _huge_1g = (edx & CPUID_EDX_PDPE1GB) != 0;
+        _nx = (edx & CPUID_EDX_NX) != 0;
+    }
+    if (_nx) wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
 
-    // map framebuffer in existing address space
-    uint64_t framebuffer_base = (uint64_t)boot_info->framebuffer->base_address;
+    memory_info_t *memory_info = boot_info->memory_info;
+
+    // map framebuffer write-combining, first so the direct map below cannot claim it as write-back.
+    // the loader hands it over as a direct map address like every other pointer in boot_info
+    uint64_t framebuffer_base = virt_to_phys(boot_info->framebuffer->base_address);
     uint64_t framebuffer_size = (uint64_t)boot_info->framebuffer->buffer_size + PAGE_SIZE; // padded just in case
-    pagetable_identity_map(pml4, (void *)framebuffer_base, framebuffer_size / PAGE_SIZE + 1);
-   
-    // load in to CR3
-    load_pml4(pml4);
+    pagetable_direct_map(pml4, framebuffer_base, framebuffer_size / PAGE_SIZE + 1, PAGE_CACHE_WC);
+
+    // up to the highest RAM address rather than the amount of RAM, every frame the allocator hands out
+    // and every page table is only ever reached through here
+    uint64_t memory_end = system_memory_end(memory_info);
+    if (!pagetable_direct_map(pml4, 0, memory_end / PAGE_SIZE, PAGE_CACHE_WB)) {
+        panic("direct map failed");
+        while(true);
+    }
+
+    // every kernel half PML4 entry gets its table now and never changes after, so address spaces
+    // that copy them with pagetable_share_kernel see everything the kernel maps later on
+    for (int i = KERNEL_HALF_INDEX; i < 512; i++) {
+        mapping_table_t *table;
+        __walk(pml4, (uint64_t)i << (PAGE_SHIFT + (9 * LEVEL_PML4)), LEVEL_PDPT, &table);
+    }
+
+    // the image where it is linked, nothing is left mapped in the lower half. text and rodata run up to
+    // the 2 MiB block the next section starts on and get huge pages
+    uint64_t nx = _nx ? PAGE_XD_NX : 0;
+    __map_section(pml4, &_TextStart, &_RodataStart, PAGE_KERNEL_FLAGS & ~PAGE_BIT_RW_WRITABLE);
+    __map_section(pml4, &_RodataStart, &_DataStart, (PAGE_KERNEL_FLAGS & ~PAGE_BIT_RW_WRITABLE) | nx);
+    __map_section(pml4, &_DataStart, &_BssEnd, PAGE_KERNEL_FLAGS | nx);
+
+    // load in to CR3, from here on text and rodata cannot be written to
+    load_pml4(virt_to_phys(pml4));
+    write_cr0(read_cr0() | CR0_WP);
+    address_space_cpu_init();
+}
+
+// a NULL physical address is taken to be a failed frame request
+bool pagetable_map(pml4_t *pml4, void *logical_address, void *physical_address)
+{
+    if (physical_address == NULL) return false;
+    return pagetable_map_range(pml4, logical_address, physical_address, 1, PAGE_KERNEL_FLAGS, PAGE_CACHE_WB);
+}
+
+// maps page_count pages of contiguous physical memory, walking the tables once per page table.
+// pages that are already mapped are left as they are
+bool pagetable_map_range(pml4_t *pml4, void *logical_address, void *physical_address, size_t page_count, uint64_t flags, PAGE_CACHE_TYPE cache)
+{
+    uint64_t address = (uint64_t)logical_address & PAGE_MASK;
+    uint64_t physical = (uint64_t)physical_address & PAGE_ADDR_MASK;
+    flags |= CACHE_BITS(cache);
+
+    while (page_count > 0) {
+        mapping_table_t *pt;
+        if (!__walk(pml4, address, LEVEL_PT, &pt)) return false;
+
+        uint64_t index = TABLE_INDEX(address, LEVEL_PT);
+        uint64_t count = 512 - index;
+        if (count > page_count) count = page_count;
+
+        // a NULL table means a huge page already covers this stretch
+        for (uint64_t i = 0; pt != NULL && i < count; i++) {
+            if (pt->entries[index + i] & PAGE_BIT_P_PRESENT) continue;
+            pt->entries[index + i] = (physical + (i * PAGE_SIZE)) | flags | PAGE_BIT_P_PRESENT;
+        }
+
+        address += count * PAGE_SIZE;
+        physical += count * PAGE_SIZE;
+        page_count -= count;
+    }
+    return true;
+}
+
+bool pagetable_unmap(pml4_t *pml4, void *logical_address, tlb_batch_t *batch)
+{
+    return pagetable_unmap_range(pml4, logical_address, 1, batch);
+}
+
+// removes the mappings in the range, false if it would have to split a huge page
+bool pagetable_unmap_range(pml4_t *pml4, void *logical_address, size_t page_count, tlb_batch_t *batch)
+{
+    return __update_range(pml4, (uint64_t)logical_address, page_count, ~0ULL, 0, batch);
+}
+
+// frees the page tables under every 2 MiB block wholly inside the range that no longer hold any entry,
+// for ranges handed back for good. a later mapping there allocates a fresh table
+void pagetable_free_tables(pml4_t *pml4, void *logical_address, size_t page_count)
+{
+    uint64_t address = ((uint64_t)logical_address + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    uint64_t end = ((uint64_t)logical_address + (page_count * PAGE_SIZE)) & ~(PAGE_SIZE_2M - 1);
+
+    void *tables[TLB_BATCH_MAX];
+    size_t count = 0;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (; address < end; address += PAGE_SIZE_2M) {
+        int level;
+        uint64_t *entry = __find_entry(pml4, address, &level);
+        if (level != LEVEL_PT) continue;
+
+        // swapped out pages keep non-present entries, a table holding one is still in use
+        mapping_table_t *table = (mapping_table_t *)((uint64_t)entry & PAGE_MASK);
+        bool empty = true;
+        for (int i = 0; i < 512 && empty; i++) empty = table->entries[i] == 0;
+        if (!empty) continue;
+
+        mapping_table_t *pd;
+        if (!__walk(pml4, address, LEVEL_PD, &pd) || pd == NULL) continue;
+        pd->entries[TABLE_INDEX(address, LEVEL_PD)] = 0;
+        tlb_batch_add(&batch, (void *)address);
+        tables[count++] = table;
+        if (count == TLB_BATCH_MAX) {
+            __free_tables(tables, count, &batch);
+            count = 0;
+        }
+    }
+    __free_tables(tables, count, &batch);
+}
+
+// sets the writable, user and no-execute bits of every mapped page in the range to those in flags
+bool pagetable_protect(pml4_t *pml4, void *logical_address, size_t page_count, uint64_t flags, tlb_batch_t *batch)
+{
+    uint64_t value = flags & PROTECT_MASK;
+    if (!_nx) value &= ~PAGE_XD_NX; // a reserved bit without EFER.NXE
+    return __update_range(pml4, (uint64_t)logical_address, page_count, PROTECT_MASK, value, batch);
+}
+
+// points the kernel half of pml4 at the tables of kernel, the lower half is left as it is
+void pagetable_share_kernel(pml4_t *pml4, pml4_t *kernel)
+{
+    for (int i = KERNEL_HALF_INDEX; i < 512; i++) {
+        pml4->entries[i] = kernel->entries[i];
+    }
+}
+
+// the physical address a logical one maps to, NULL when it is not mapped. phys_to_virt turns it in to
+// the direct map address of the frame
+void* pagetable_translate(pml4_t *pml4, void *logical_address)
+{
+    int level;
+    uint64_t *entry = __find_entry(pml4, (uint64_t)logical_address, &level);
+    if (!(*entry & PAGE_BIT_P_PRESENT)) return NULL;
+
+    uint64_t offset = (uint64_t)logical_address & ((LEVEL_PAGES(level) * PAGE_SIZE) - 1);
+    return (void *)((*entry & PAGE_ADDR_MASK & ~((LEVEL_PAGES(level) * PAGE_SIZE) - 1)) + offset);
+}
+
+// the page table entry for a 4 KiB page, present or not, NULL when no page table covers the address
+// or a huge page maps it. for callers that keep their own state in non-present entries
+uint64_t* pagetable_entry(pml4_t *pml4, void *logical_address)
+{
+    int level;
+    uint64_t *entry = __find_entry(pml4, (uint64_t)logical_address, &level);
+    return level == LEVEL_PT ? entry : NULL;
+}
+
+// maps physical memory at its direct map address, phys_to_virt(physical). never executable, the
+// kernel's own text is reached there too and only its KERNEL_VMA mapping may run it
+bool pagetable_direct_map(pml4_t *pml4, uint64_t physical, size_t page_count, PAGE_CACHE_TYPE cache)
+{
+    physical &= PAGE_MASK;
+    uint64_t flags = PAGE_KERNEL_FLAGS | (_nx ? PAGE_XD_NX : 0);
+    return __map_huge_range(pml4, (uint64_t)phys_to_virt(physical), physical, page_count, flags, cache);
+}
+
+// finds the table holding the entry for address at the given level, creating missing tables on the way.
+// *table is NULL if a huge page above that level already maps the address; false when out of frames.
+// new tables need no mapping of their own, they are reached through the direct map. until the frame
+// allocator takes over they come from memblock
+static bool __walk(pml4_t *pml4, uint64_t address, int level, mapping_table_t **table)
+{
+    // user mappings need the user bit on every table above them, the kernel half never has it
+    uint64_t flags = PAGE_BIT_P_PRESENT | TABLE_FLAGS;
+    if (TABLE_INDEX(address, LEVEL_PML4) < KERNEL_HALF_INDEX) flags |= PAGE_BIT_US_USER;
+
+    mapping_table_t *current_table = pml4;
+    for (int current = LEVEL_PML4; current > level; current--) {
+        uint64_t *entry = &current_table->entries[TABLE_INDEX(address, current)];
+        if (!(*entry & PAGE_BIT_P_PRESENT)) {
+            uint64_t table_alloc = (uint64_t)(memblock_active() ? memblock_alloc(PAGE_SIZE) : pageframe_request_zeroed());
+            if (table_alloc == 0) return false;
+            pageframe_set_owner((void *)table_alloc, PAGEFRAME_OWNER_PAGETABLE);
+            *entry = (virt_to_phys((void *)table_alloc) & PAGE_ADDR_MASK) | flags;
+        } else if (*entry & PAGE_BIT_PS_HUGE) {
+            *table = NULL;
+            return true;
+        }
+        current_table = (mapping_table_t *)phys_to_virt(*entry & PAGE_ADDR_MASK);
+    }
+    *table = current_table;
+    return true;
+}
+
+// returns the entry mapping address, a page table entry or a huge page entry, and its level.
+// for an unmapped address it is the first non-present entry on the way down
+static uint64_t* __find_entry(pml4_t *pml4, uint64_t address, int *level)
+{
+    mapping_table_t *table = pml4;
+    for (int current = LEVEL_PML4; ; current--) {
+        uint64_t *entry = &table->entries[TABLE_INDEX(address, current)];
+        if (current == LEVEL_PT || !(*entry & PAGE_BIT_P_PRESENT) || (*entry & PAGE_BIT_PS_HUGE)) {
+            *level = current;
+            return entry;
+        }
+        table = (mapping_table_t *)phys_to_virt(*entry & PAGE_ADDR_MASK);
+    }
 }
 
-void pagetable_map(pml4_t *pml4, void *logical_address, void *physical_address)
+// uses 1 GiB and 2 MiB pages wherever both addresses are aligned for them, 4 KiB pages for the rest
+static bool __map_huge_range(pml4_t *pml4, uint64_t address, uint64_t physical, size_t page_count, uint64_t flags, PAGE_CACHE_TYPE cache)
 {
-    /* flags: page is present, user readable and writable */
-    int flags = PAGE_BIT_P_PRESENT | PAGE_BIT_RW_WRITABLE | PAGE_BIT_US_USER;
+    uint64_t end = address + (page_count * PAGE_SIZE);
 
-    int pml4_idx = ((uint64_t)logical_address >> 39) & 0x1FF;
-    int pdp_idx = ((uint64_t)logical_address >> 30) & 0x1FF;
-    int pd_idx = ((uint64_t)logical_address >> 21) & 0x1FF;
-    int pt_idx = ((uint64_t)logical_address >> 12) & 0x1FF;
+    while (address < end) {
+        bool mapped = false;
+        if (_huge_1g && ((address | physical) & (PAGE_SIZE_1G - 1)) == 0 && end - address >= PAGE_SIZE_1G) {
+            if (!__map_huge(pml4, address, physical, LEVEL_PDPT, flags, cache, &mapped)) return false;
+            if (mapped) {
+                address += PAGE_SIZE_1G;
+                physical += PAGE_SIZE_1G;
+                continue;
+            }
+        }
+        if (((address | physical) & (PAGE_SIZE_2M - 1)) == 0 && end - address >= PAGE_SIZE_2M) {
+            if (!__map_huge(pml4, address, physical, LEVEL_PD, flags, cache, &mapped)) return false;
+            if (mapped) {
+                address += PAGE_SIZE_2M;
+                physical += PAGE_SIZE_2M;
+                continue;
+            }
+        }
 
-    if (!(pml4->entries[pml4_idx] & PAGE_BIT_P_PRESENT)) {
-        uint64_t pdpt_alloc = (uint64_t)pageframe_request();
-        memzero((void *)pdpt_alloc, PAGE_SIZE);
-        pml4->entries[pml4_idx] = (pdpt_alloc & PAGE_ADDR_MASK) | flags;
-        pagetable_map(pml4, (void *)pdpt_alloc, (void *)pdpt_alloc);
+        // the rest of this 2 MiB stretch, or of the range, in 4 KiB pages
+        uint64_t stretch = PAGE_SIZE_2M - (address & (PAGE_SIZE_2M - 1));
+        if (stretch > end - address) stretch = end - address;
+        if (!pagetable_map_range(pml4, (void *)address, (void *)physical, stretch / PAGE_SIZE, flags, cache)) return false;
+        address += stretch;
+        physical += stretch;
     }
+    return true;
+}
+
+// maps one huge page at the PDPT (1 GiB) or PD (2 MiB) level. *mapped stays false when smaller
+// mappings already exist there and the range has to be filled in with smaller pages
+static bool __map_huge(pml4_t *pml4, uint64_t address, uint64_t physical, int level, uint64_t flags, PAGE_CACHE_TYPE cache, bool *mapped)
+{
+    flags |= PAGE_BIT_P_PRESENT | PAGE_BIT_PS_HUGE | CACHE_BITS(cache);
 
-    mapping_table_t *pdpt = (mapping_table_t *)(pml4->entries[pml4_idx] & PAGE_ADDR_MASK);
-    if (!(pdpt->entries[pdp_idx] & PAGE_BIT_P_PRESENT)) {
-        uint64_t pdt_alloc = (uint64_t)pageframe_request();
-        memzero((void *)pdt_alloc, PAGE_SIZE);
-        pdpt->entries[pdp_idx] = (pdt_alloc & PAGE_ADDR_MASK) | flags;
-        pagetable_map(pml4, (void *)pdt_alloc, (void *)pdt_alloc);
+    mapping_table_t *table;
+    if (!__walk(pml4, address, level, &table)) return false;
+    if (table == NULL) {
+        *mapped = true;
+        return true;
     }
 
-    mapping_table_t *pdt = (mapping_table_t *)(pdpt->entries[pdp_idx] & PAGE_ADDR_MASK);
-    if (!(pdt->entries[pd_idx] & PAGE_BIT_P_PRESENT)) {
-        uint64_t pt_alloc = (uint64_t)pageframe_request();
-        memzero((void *)pt_alloc, PAGE_SIZE);
-        pdt->entries[pd_idx] = (pt_alloc & PAGE_ADDR_MASK) | flags;
-        pagetable_map(pml4, (void *)pt_alloc, (void *)pt_alloc);
+    uint64_t *entry = &table->entries[TABLE_INDEX(address, level)];
+    if (*entry & PAGE_BIT_P_PRESENT) {
+        *mapped = (*entry & PAGE_BIT_PS_HUGE) != 0;
+        return true;
     }
 
-    mapping_table_t *pt = (mapping_table_t *)(pdt->entries[pd_idx] & PAGE_ADDR_MASK);
-    if (!(pt->entries[pt_idx] & PAGE_BIT_P_PRESENT)) {
-        pt->entries[pt_idx] = ((uint64_t)physical_address & PAGE_ADDR_MASK) | flags;
+    *entry = (physical & PAGE_ADDR_MASK) | flags;
+    *mapped = true;
+    return true;
+}
+
+// rewrites each present leaf entry in the range as (entry & ~mask) | value. changed pages are queued on
+// batch for the caller to flush, or flushed before returning when batch is NULL. false if the range
+// covers only part of a huge page, splitting one is not supported
+static bool __update_range(pml4_t *pml4, uint64_t address, size_t page_count, uint64_t mask, uint64_t value, tlb_batch_t *batch)
+{
+    tlb_batch_t local;
+    tlb_batch_init(&local);
+    tlb_batch_t *pending = batch != NULL ? batch : &local;
+
+    bool updated = true;
+    address &= PAGE_MASK;
+    while (page_count > 0) {
+        int level;
+        uint64_t *entry = __find_entry(pml4, address, &level);
+
+        uint64_t count = LEVEL_PAGES(level) - ((address / PAGE_SIZE) & (LEVEL_PAGES(level) - 1));
+        if (level == LEVEL_PT) count = 512 - TABLE_INDEX(address, LEVEL_PT);
+        if (count > page_count) count = page_count;
+
+        if (level == LEVEL_PT) {
+            for (uint64_t i = 0; i < count; i++) {
+                __update_entry(&entry[i], address + (i * PAGE_SIZE), mask, value, pending);
+            }
+        } else if (*entry & PAGE_BIT_P_PRESENT) {
+            if (count != LEVEL_PAGES(level)) {
+                updated = false;
+                break;
+            }
+            __update_entry(entry, address, mask, value, pending);
+        }
+
+        address += count * PAGE_SIZE;
+        page_count -= count;
     }
+
+    if (batch == NULL) tlb_batch_flush(&local);
+    return updated;
+}
+
+static void __update_entry(uint64_t *entry, uint64_t address, uint64_t mask, uint64_t value, tlb_batch_t *batch)
+{
+    if (!(*entry & PAGE_BIT_P_PRESENT)) return;
+
+    uint64_t updated = (*entry & ~mask) | value;
+    if (updated == *entry) return;
+
+    *entry = updated;
+    tlb_batch_add(batch, (void *)address);
 }
 
-void pagetable_identity_map(pml4_t *pml4, void *start, size_t page_count)
+// maps the image from start up to end at the physical addresses it was loaded at
+static bool __map_section(pml4_t *pml4, void *start, void *end, uint64_t flags)
 {
-    for(uint64_t i = 0; i < page_count; i++) {
-        uint64_t addr = (uint64_t)start + (i * PAGE_SIZE);
-        pagetable_map(pml4, (void *)addr, (void *)addr);
+    size_t page_count = ((uint64_t)end - (uint64_t)start + PAGE_SIZE - 1) / PAGE_SIZE;
+    return __map_huge_range(pml4, (uint64_t)start, virt_to_phys(start), page_count, flags, PAGE_CACHE_WB);
+}
+
+// the paging-structure caches may still hold a table until its addresses are flushed
+static void __free_tables(void **tables, size_t count, tlb_batch_t *batch)
+{
+    tlb_batch_flush(batch);
+    tlb_batch_init(batch);
+    for (size_t i = 0; i < count; i++) {
+        pageframe_free(tables[i]);
     }
-}
\ No newline at end of file
+}
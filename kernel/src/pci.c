@@ -5,6 +5,8 @@
 #include "globals.h"
 #include "ahci.h"
 #include "heap.h"
+#include "paging.h"
+#include "vmap.h"
 
 #define BUS_DEVICE_CNT 32
 #define DEVICE_FUNS_CNT 8
@@ -170,11 +172,15 @@ const char* pci_program_iface(uint8_t class_code, uint8_t subclass_code, uint8_t
 
 static void __enumerate_bus(uint64_t base_address, uint64_t bus)
 {
-    uint64_t bus_address = base_address + (bus << 20);
-    pagetable_map(g_pml4, (void *)bus_address, (void *)bus_address);
+    // the whole 1 MiB of the bus's configuration space, so devices and functions need no mapping of their own.
+    // it stays mapped for the drivers of the devices found on it
+    uint64_t bus_address = (uint64_t)ioremap(base_address + (bus << 20), 1 << 20, PAGE_CACHE_UC);
+    if (bus_address == 0) return;
     pci_device_hdr_t *dev_hdr = (pci_device_hdr_t *)bus_address;
-    if (dev_hdr->device_id == 0) return; // device not valid
-    if (dev_hdr->device_id == 0xFFFF) return; // device not valid
+    if (dev_hdr->device_id == 0 || dev_hdr->device_id == 0xFFFF) {
+        vunmap(dev_hdr); // device not valid
+        return;
+    }
 
     for (uint64_t device = 0; device < BUS_DEVICE_CNT; device++) {
         __enumerate_device(bus_address, device);
@@ -184,7 +190,6 @@ static void __enumerate_bus(uint64_t base_address, uint64_t bus)
 static void __enumerate_device(uint64_t bus_address, uint64_t device)
 {
     uint64_t device_address = bus_address + (device << 15);
-    pagetable_map(g_pml4, (void *)device_address, (void *)device_address);
     pci_device_hdr_t *dev_hdr = (pci_device_hdr_t *)device_address;
     if (dev_hdr->device_id == 0) return;
     if (dev_hdr->device_id == 0xFFFF) return;
@@ -197,7 +202,6 @@ static void __enumerate_device(uint64_t bus_address, uint64_t device)
 static void __enumerate_function(uint64_t device_address, uint64_t function)
 {
     uint64_t function_address = device_address + (function << 12);
-    pagetable_map(g_pml4, (void *)function_address, (void *)function_address);
     pci_device_hdr_t *dev_hdr = (pci_device_hdr_t *)function_address;
     if (dev_hdr->device_id == 0) return;
     if (dev_hdr->device_id == 0xFFFF) return;
@@ -0,0 +1,13 @@
+#include "percpu.h"
+
+#include "cpu.h"
+
+static percpu_t _cpus[MAX_CPUS];
+
+void percpu_init(uint32_t id)
+{
+    percpu_t *cpu = &_cpus[id];
+    cpu->self = cpu;
+    cpu->id = id;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
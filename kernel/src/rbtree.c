@@ -0,0 +1,247 @@
+#include "rbtree.h"
+
+// private functions
+static void __rotate_left(rb_tree_t *tree, rb_node_t *node);
+static void __rotate_right(rb_tree_t *tree, rb_node_t *node);
+static void __replace(rb_tree_t *tree, rb_node_t *node, rb_node_t *child);
+static void __insert_fixup(rb_tree_t *tree, rb_node_t *node);
+static void __erase_fixup(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent);
+
+// links node in at *link, a child pointer of parent found by the caller's own search (&tree->root and NULL
+// for an empty tree), then rebalances
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    rb_propagate(tree, node);
+    __insert_fixup(tree, node);
+}
+
+void rb_erase(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *child;
+    rb_node_t *parent;
+    bool red;
+
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        red = node->red;
+        __replace(tree, node, child);
+        if (child != NULL) child->parent = parent;
+    } else {
+        // the successor takes the node's place, colour included
+        rb_node_t *successor = node->right;
+        while (successor->left != NULL) successor = successor->left;
+
+        child = successor->right;
+        red = successor->red;
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            parent->left = child;
+            if (child != NULL) child->parent = parent;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        __replace(tree, node, successor);
+        successor->parent = node->parent;
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->red = node->red;
+    }
+
+    // cached values change from the lowest node that lost a descendant up
+    rb_propagate(tree, parent);
+    if (!red) __erase_fixup(tree, child, parent);
+}
+
+// refreshes the cached values from node up to the root, for callers that changed what a node covers
+void rb_propagate(rb_tree_t *tree, rb_node_t *node)
+{
+    if (tree->update == NULL) return;
+    for (; node != NULL; node = node->parent) {
+        tree->update(node);
+    }
+}
+
+rb_node_t* rb_first(rb_tree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    if (node == NULL) return NULL;
+    while (node->left != NULL) node = node->left;
+    return node;
+}
+
+rb_node_t* rb_next(rb_node_t *node)
+{
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) node = node->left;
+        return node;
+    }
+    while (node->parent != NULL && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
+
+rb_node_t* rb_prev(rb_node_t *node)
+{
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) node = node->right;
+        return node;
+    }
+    while (node->parent != NULL && node == node->parent->left) node = node->parent;
+    return node->parent;
+}
+
+// a rotation keeps the set of nodes under the pair, so only the two rotated need updating
+static void __rotate_left(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *pivot = node->right;
+    node->right = pivot->left;
+    if (pivot->left != NULL) pivot->left->parent = node;
+    __replace(tree, node, pivot);
+    pivot->parent = node->parent;
+    pivot->left = node;
+    node->parent = pivot;
+
+    if (tree->update != NULL) {
+        tree->update(node);
+        tree->update(pivot);
+    }
+}
+
+static void __rotate_right(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *pivot = node->left;
+    node->left = pivot->right;
+    if (pivot->right != NULL) pivot->right->parent = node;
+    __replace(tree, node, pivot);
+    pivot->parent = node->parent;
+    pivot->right = node;
+    node->parent = pivot;
+
+    if (tree->update != NULL) {
+        tree->update(node);
+        tree->update(pivot);
+    }
+}
+
+// points node's parent, or the root, at child instead
+static void __replace(rb_tree_t *tree, rb_node_t *node, rb_node_t *child)
+{
+    if (node->parent == NULL) tree->root = child;
+    else if (node == node->parent->left) node->parent->left = child;
+    else node->parent->right = child;
+}
+
+static void __insert_fixup(rb_tree_t *tree, rb_node_t *node)
+{
+    while (node->parent != NULL && node->parent->red) {
+        rb_node_t *parent = node->parent;
+        rb_node_t *grandparent = parent->parent;
+
+        if (parent == grandparent->left) {
+            rb_node_t *uncle = grandparent->right;
+            if (uncle != NULL && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                __rotate_left(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            __rotate_right(tree, grandparent);
+        } else {
+            rb_node_t *uncle = grandparent->left;
+            if (uncle != NULL && uncle->red) {
+                parent->red = false;
+                uncle->red = false;
+                grandparent->red = true;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                __rotate_right(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grandparent->red = true;
+            __rotate_left(tree, grandparent);
+        }
+    }
+    tree->root->red = false;
+}
+
+// node, possibly NULL, carries an extra black after a black node was removed above it
+static void __erase_fixup(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent)
+{
+    while (node != tree->root && (node == NULL || !node->red)) {
+        if (node == parent->left) {
+            rb_node_t *sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                __rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) && (sibling->right == NULL || !sibling->right->red)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (sibling->right == NULL || !sibling->right->red) {
+                sibling->left->red = false;
+                sibling->red = true;
+                __rotate_right(tree, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            __rotate_left(tree, parent);
+            node = tree->root;
+        } else {
+            rb_node_t *sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                __rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+            if ((sibling->left == NULL || !sibling->left->red) && (sibling->right == NULL || !sibling->right->red)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (sibling->left == NULL || !sibling->left->red) {
+                sibling->right->red = false;
+                sibling->red = true;
+                __rotate_left(tree, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            __rotate_right(tree, parent);
+            node = tree->root;
+        }
+    }
+    if (node != NULL) node->red = false;
+}
@@ -0,0 +1,226 @@
+#include "slab.h"
+
+#include "cpu.h"
+#include "bitmap.h"
+#include "paging.h"
+#include "pageframe_allocator.h"
+#include "sections.h"
+
+#define MIN_OBJECTS 8                   // slabs grow past one frame until they hold this many objects
+#define MAX_SLAB_ORDER 3
+#define SLAB_BYTES(cache) (PAGE_SIZE << (cache)->order)
+#define SLAB(cache, object) ((kmem_slab_t *)((uint64_t)(object) & ~(SLAB_BYTES(cache) - 1)))
+#define ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
+
+// lives at the start of the slab's frames, frame blocks are aligned to their size so objects find it by masking
+struct kmem_slab_t {
+    kmem_cache_t *cache;
+    kmem_slab_t *next;
+    kmem_slab_t *prev;
+    void *free;                         // first free object, each holds a pointer to the next
+    uint64_t inuse;
+    bitmap_t bitmap;                    // set while an object is allocated
+};
+
+static kmem_cache_t _cache_cache;      // the cache kmem_cache_t descriptors come from
+
+// private functions
+static void __init_cache(kmem_cache_t *cache, const char *name, size_t size, size_t align, void (*ctor)(void *));
+static uint64_t __capacity(size_t size, size_t align, unsigned int order, size_t *offset);
+static kmem_slab_t* __grow(kmem_cache_t *cache);
+static void __push(kmem_slab_t **list, kmem_slab_t *slab);
+static void __remove(kmem_slab_t **list, kmem_slab_t *slab);
+
+kmem_cache_t* kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *))
+{
+    if (size == 0) return NULL;
+    if (_cache_cache.size == 0) __init_cache(&_cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+
+    kmem_cache_t *cache = (kmem_cache_t *)kmem_cache_alloc(&_cache_cache);
+    if (cache == NULL) return NULL;
+
+    __init_cache(cache, name, size, align, ctor);
+    if (cache->capacity == 0) {
+        kmem_cache_free(&_cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// only a cache with no objects handed out can be destroyed
+bool kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (cache->partial != NULL || cache->full != NULL) return false;
+
+    if (cache->empty != NULL) pageframe_free_n(cache->empty, cache->order);
+    kmem_cache_free(&_cache_cache, cache);
+    return true;
+}
+
+HOT_TEXT void* kmem_cache_alloc(kmem_cache_t *cache)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&cache->lock);
+
+    kmem_slab_t *slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty != NULL ? cache->empty : __grow(cache);
+        cache->empty = NULL;
+        if (slab == NULL) {
+            spinlock_release(&cache->lock);
+            irq_restore(flags);
+            return NULL;
+        }
+        __push(&cache->partial, slab);
+    }
+
+    void *object = slab->free;
+    slab->free = *(void **)object;
+    bitmap_set(&slab->bitmap, ((uint64_t)object - (uint64_t)slab - cache->offset) / cache->size);
+    if (++slab->inuse == cache->capacity) {
+        __remove(&cache->partial, slab);
+        __push(&cache->full, slab);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.active++;
+    spinlock_release(&cache->lock);
+    irq_restore(flags);
+
+    if (cache->ctor != NULL) cache->ctor(object);
+    return object;
+}
+
+HOT_TEXT void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+    if (object == NULL) return;
+
+    kmem_slab_t *slab = SLAB(cache, object);
+    uint64_t index = ((uint64_t)object - (uint64_t)slab - cache->offset) / cache->size;
+
+    uint64_t flags = irq_save();
+    spinlock_acquire(&cache->lock);
+
+    // foreign pointers and double frees are ignored
+    if (slab->cache != cache || index >= cache->capacity || !bitmap_check(&slab->bitmap, index)) {
+        spinlock_release(&cache->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    bitmap_clear(&slab->bitmap, index);
+    *(void **)object = slab->free;
+    slab->free = object;
+
+    if (slab->inuse-- == cache->capacity) {
+        __remove(&cache->full, slab);
+        __push(&cache->partial, slab);
+    }
+
+    kmem_slab_t *release = NULL;
+    if (slab->inuse == 0) {
+        __remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            release = slab;
+            cache->stats.slabs--;
+        }
+    }
+
+    cache->stats.frees++;
+    cache->stats.active--;
+    spinlock_release(&cache->lock);
+    irq_restore(flags);
+
+    if (release != NULL) pageframe_free_n(release, cache->order);
+}
+
+void kmem_cache_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&cache->lock);
+    *stats = cache->stats;
+    spinlock_release(&cache->lock);
+    irq_restore(flags);
+}
+
+static void __init_cache(kmem_cache_t *cache, const char *name, size_t size, size_t align, void (*ctor)(void *))
+{
+    uint64_t i = 0;
+    for (; name[i] != '\0' && i < KMEM_NAME_MAX - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = '\0';
+
+    if (align == 0) align = KMEM_CACHE_LINE;
+    if (align < sizeof(void *)) align = sizeof(void *);
+    cache->align = align;
+    cache->size = ALIGN_UP(size, align);
+    cache->ctor = ctor;
+
+    cache->order = 0;
+    cache->capacity = __capacity(cache->size, align, 0, &cache->offset);
+    while (cache->capacity < MIN_OBJECTS && cache->order < MAX_SLAB_ORDER) {
+        cache->order++;
+        cache->capacity = __capacity(cache->size, align, cache->order, &cache->offset);
+    }
+
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->stats = (kmem_cache_stats_t){ 0 };
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+}
+
+// how many objects fit in a slab of the order once the header and bitmap are taken out
+static uint64_t __capacity(size_t size, size_t align, unsigned int order, size_t *offset)
+{
+    size_t bytes = PAGE_SIZE << order;
+    uint64_t capacity = bytes / size;
+    while (capacity > 0) {
+        *offset = ALIGN_UP(sizeof(kmem_slab_t) + bitmap_buffer_size((capacity / 8) + 1), align);
+        if (*offset + (capacity * size) <= bytes) break;
+        capacity--;
+    }
+    return capacity;
+}
+
+static kmem_slab_t* __grow(kmem_cache_t *cache)
+{
+    kmem_slab_t *slab = (kmem_slab_t *)pageframe_request_n(cache->order);
+    if (slab == NULL) return NULL;
+    pageframe_set_owner(slab, PAGEFRAME_OWNER_SLAB);
+
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->inuse = 0;
+    bitmap_init(&slab->bitmap, (cache->capacity / 8) + 1, (uint8_t *)slab + sizeof(kmem_slab_t));
+
+    // thread the free list through the objects in address order
+    uint8_t *object = (uint8_t *)slab + cache->offset;
+    slab->free = object;
+    for (uint64_t i = 0; i + 1 < cache->capacity; i++, object += cache->size) {
+        *(void **)object = object + cache->size;
+    }
+    *(void **)object = NULL;
+
+    cache->stats.slabs++;
+    return slab;
+}
+
+static void __push(kmem_slab_t **list, kmem_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next != NULL) slab->next->prev = slab;
+    *list = slab;
+}
+
+static void __remove(kmem_slab_t **list, kmem_slab_t *slab)
+{
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+}
@@ -0,0 +1,198 @@
+#include "swap.h"
+
+#include <string.h>
+
+#include "paging.h"
+#include "pageframe_allocator.h"
+#include "bitmap.h"
+#include "spinlock.h"
+#include "cpu.h"
+
+#define SECTOR_SIZE 512
+#define SLOT_SECTORS (PAGE_SIZE / SECTOR_SIZE)
+#define DMA32_LIMIT 0x100000000UL
+#define GPT_HEADER_SECTOR 1
+#define GPT_SIGNATURE "EFI PART"
+
+typedef struct {
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc;
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+} __attribute__((packed)) gpt_header_t;
+
+typedef struct {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+} __attribute__((packed)) gpt_entry_t;
+
+// the linux swap partition type, 0657FD6D-A4AB-43C4-84E5-0933C84B4F4F as it is laid out on disk
+static const uint8_t _swap_type[16] = {
+    0x6D, 0xFD, 0x57, 0x06, 0xAB, 0xA4, 0xC4, 0x43, 0x84, 0xE5, 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F
+};
+
+static ahci_port_t *_port;
+static uint64_t _sector;                        // first sector of the swap area
+static uint64_t _slots;
+static uint64_t _slots_used;
+static uint64_t _next;                          // where the search for a free slot starts
+static bitmap_t _map;                           // one bit per slot, set while it holds a page
+static void *_bounce[SWAP_BATCH];               // for frames the HBA cannot reach
+static spinlock_t _lock = SPINLOCK_INIT;
+
+// private functions
+static void* __dma_buffer(unsigned int index, void *frame);
+static bool __find_partition(ahci_port_t *port, void *buffer, uint64_t *sector, uint64_t *slots);
+
+// looks for a swap partition in the GPT of the disk on port. nothing else on a disk is ever used as swap
+bool swap_find(ahci_port_t *port, uint64_t *sector, uint64_t *slots)
+{
+    void *buffer = pageframe_request_zone(ZONE_DMA32);
+    if (buffer == NULL) return false;
+    bool found = __find_partition(port, buffer, sector, slots);
+    pageframe_free(buffer);
+    return found;
+}
+
+// takes slots pages of disk from sector on as the swap area, a range swap_find handed out
+bool swap_init(ahci_port_t *port, uint64_t sector, uint64_t slots)
+{
+    // straight from the frame allocator, eviction takes slots with locks held and interrupts off and
+    // cannot fault on its own bitmap
+    size_t bytes = bitmap_buffer_size((slots / 8) + 1);
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < bytes) order++;
+    void *buffer = pageframe_request_n(order);
+    if (buffer == NULL) return false;
+
+    for (unsigned int i = 0; i < SWAP_BATCH; i++) {
+        if (port->dma64) break;
+        _bounce[i] = pageframe_request_zone(ZONE_DMA32);
+        if (_bounce[i] == NULL) {
+            while (i-- > 0) {
+                pageframe_free(_bounce[i]);
+                _bounce[i] = NULL;
+            }
+            pageframe_free_n(buffer, order);
+            return false;
+        }
+    }
+
+    bitmap_init(&_map, (slots / 8) + 1, buffer);
+    _sector = sector;
+    _slots = slots;
+    _port = port;
+    return true;
+}
+
+bool swap_enabled(void)
+{
+    return _port != NULL;
+}
+
+uint64_t swap_alloc(void)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    uint64_t slot = bitmap_find_first_zero(&_map, _next);
+    if (slot == BITMAP_NONE || slot >= _slots) slot = bitmap_find_first_zero(&_map, 0);
+    if (slot != BITMAP_NONE && slot < _slots) {
+        bitmap_set(&_map, slot);
+        _slots_used++;
+        _next = slot + 1;
+    } else {
+        slot = SWAP_NONE;
+    }
+    spinlock_release(&_lock);
+    irq_restore(flags);
+    return slot;
+}
+
+void swap_free(uint64_t slot)
+{
+    uint64_t flags = irq_save();
+    spinlock_acquire(&_lock);
+    if (bitmap_check(&_map, slot)) {
+        bitmap_clear(&_map, slot);
+        _slots_used--;
+    }
+    spinlock_release(&_lock);
+    irq_restore(flags);
+}
+
+// starts writing frame out to slot, returning the command to pass to swap_write_end or -1. index picks
+// the bounce buffer, one per write in flight. the caller serialises swap i/o
+int swap_write_begin(unsigned int index, uint64_t slot, void *frame)
+{
+    void *buffer = __dma_buffer(index, frame);
+    if (buffer != frame) memcpy(buffer, frame, PAGE_SIZE);
+    return ahci_issue(_port, _sector + (slot * SLOT_SECTORS), SLOT_SECTORS, buffer, true);
+}
+
+bool swap_write_end(int command)
+{
+    return command >= 0 && ahci_wait(_port, command);
+}
+
+bool swap_read(uint64_t slot, void *frame)
+{
+    void *buffer = __dma_buffer(0, frame);
+    if (!ahci_read(_port, _sector + (slot * SLOT_SECTORS), SLOT_SECTORS, buffer)) return false;
+    if (buffer != frame) memcpy(frame, buffer, PAGE_SIZE);
+    return true;
+}
+
+uint64_t swap_slots_used(void)
+{
+    return _slots_used;
+}
+
+static bool __find_partition(ahci_port_t *port, void *buffer, uint64_t *sector, uint64_t *slots)
+{
+    if (!ahci_read(port, GPT_HEADER_SECTOR, 1, buffer)) return false;
+
+    gpt_header_t *header = buffer;
+    if (memcmp(header->signature, GPT_SIGNATURE, sizeof(header->signature)) != 0) return false;
+    if (header->entry_size < sizeof(gpt_entry_t) || header->entry_size > PAGE_SIZE) return false;
+
+    uint64_t entries_lba = header->entries_lba;
+    uint32_t entry_count = header->entry_count;
+    uint32_t entry_size = header->entry_size;
+    uint32_t per_page = PAGE_SIZE / entry_size;
+
+    // a page of entries at a time, the header in buffer is gone after the first read
+    for (uint32_t first = 0; first < entry_count; first += per_page) {
+        uint64_t offset = (uint64_t)first * entry_size;
+        if (!ahci_read(port, entries_lba + (offset / SECTOR_SIZE), SLOT_SECTORS, buffer)) return false;
+
+        for (uint32_t i = 0; i < per_page && first + i < entry_count; i++) {
+            gpt_entry_t *entry = (gpt_entry_t *)((uint8_t *)buffer + (i * entry_size));
+            if (memcmp(entry->type_guid, _swap_type, sizeof(_swap_type)) != 0) continue;
+            if (entry->last_lba < entry->first_lba) continue;
+
+            *sector = entry->first_lba;
+            *slots = (entry->last_lba - entry->first_lba + 1) / SLOT_SECTORS;
+            return *slots > 0;
+        }
+    }
+    return false;
+}
+
+static void* __dma_buffer(unsigned int index, void *frame)
+{
+    if (_port->dma64 || virt_to_phys(frame) + PAGE_SIZE <= DMA32_LIMIT) return frame;
+    return _bounce[index];
+}
@@ -0,0 +1,43 @@
+#include "tlb.h"
+
+#include "cpu.h"
+
+void tlb_batch_init(tlb_batch_t *batch)
+{
+    batch->count = 0;
+    batch->full = false;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, void *address)
+{
+    if (batch->full) return;
+    if (batch->count == TLB_BATCH_MAX) {
+        batch->full = true;
+        return;
+    }
+    batch->addresses[batch->count++] = (uint64_t)address;
+}
+
+void tlb_batch_flush(tlb_batch_t *batch)
+{
+    if (batch->full) {
+        tlb_flush_all();
+    } else {
+        for (size_t i = 0; i < batch->count; i++) {
+            invlpg((void *)batch->addresses[i]);
+        }
+    }
+    tlb_batch_init(batch);
+}
+
+// a CR3 reload keeps global entries, toggling CR4.PGE drops them along with every PCID's entries
+void tlb_flush_all(void)
+{
+    unsigned long cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3());
+    }
+}
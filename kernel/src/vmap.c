@@ -0,0 +1,316 @@
+#include "vmap.h"
+
+#include "globals.h"
+#include "paging.h"
+#include "pageframe_allocator.h"
+#include "slab.h"
+#include "rbtree.h"
+#include "spinlock.h"
+#include "cpu.h"
+
+#define PAGE_UP(address) (((uint64_t)(address) + PAGE_SIZE - 1) & PAGE_MASK)
+#define AREA(entry) rb_entry(entry, vmap_area_t, node)
+
+typedef enum {
+    VMAP_RESERVED = 0,                      // address space only, the owner maps and unmaps it
+    VMAP_MAPPED = 1,                        // frames the caller owns
+    VMAP_ALLOCATED = 2,                     // frames vmalloc took, freed with the area
+    VMAP_IOREMAP = 3
+} VMAP_TYPE;
+
+// a range of pages, free or in use. both kinds sit in a tree ordered by start
+typedef struct {
+    rb_node_t node;
+    uint64_t start;
+    uint64_t pages;                         // in use areas include their guard pages
+    uint64_t largest;                       // free tree only, the most pages in any one free range under here
+    VMAP_TYPE type;
+} vmap_area_t;
+
+static vmap_space_t _kernel;
+static kmem_cache_t *_area_cache;
+
+// private functions
+static void __update_largest(rb_node_t *node);
+static vmap_area_t* __alloc_area(vmap_space_t *space, size_t pages, VMAP_TYPE type);
+static vmap_area_t* __find_area(vmap_space_t *space, uint64_t address);
+static vmap_area_t* __take_area(vmap_space_t *space, uint64_t address);
+static void __release_area(vmap_space_t *space, vmap_area_t *area);
+static void __free_insert(vmap_space_t *space, vmap_area_t *area);
+static void __unmap_area(vmap_area_t *area);
+
+void vmap_init(void)
+{
+    _area_cache = kmem_cache_create("vmap_area", sizeof(vmap_area_t), 0, NULL);
+    if (_area_cache == NULL) return;
+    vmap_space_init(&_kernel, (void *)VMAP_START, (VMAP_END - VMAP_START) / PAGE_SIZE);
+}
+
+// hands out the pages of a window the caller owns, the heap's window for large allocations for one.
+// the first page is a guard too, every area has unmapped pages on both sides
+bool vmap_space_init(vmap_space_t *space, void *start, size_t pages)
+{
+    space->free.root = NULL;
+    space->free.update = __update_largest;
+    space->busy.root = NULL;
+    space->busy.update = NULL;
+    space->busy_count = 0;
+    space->lock = (spinlock_t)SPINLOCK_INIT;
+    if (_area_cache == NULL || pages <= VMAP_GUARD_PAGES) return false;
+
+    vmap_area_t *area = (vmap_area_t *)kmem_cache_alloc(_area_cache);
+    if (area == NULL) return false;
+    area->start = (uint64_t)start + (VMAP_GUARD_PAGES * PAGE_SIZE);
+    area->pages = pages - VMAP_GUARD_PAGES;
+    __free_insert(space, area);
+    return true;
+}
+
+// address space with nothing behind it, for owners that map it themselves
+void* vmap_space_reserve(vmap_space_t *space, size_t pages)
+{
+    vmap_area_t *area = __alloc_area(space, pages, VMAP_RESERVED);
+    return area != NULL ? (void *)area->start : NULL;
+}
+
+// gives back an area from vmap_space_reserve, which the owner has already unmapped. address may be
+// anywhere inside it
+void vmap_space_release(vmap_space_t *space, void *address)
+{
+    vmap_area_t *area = __take_area(space, (uint64_t)address);
+    if (area != NULL) __release_area(space, area);
+}
+
+// address space with nothing behind it, for owners that map it themselves such as the demand-paged heap
+void* vmap_reserve(size_t pages)
+{
+    return vmap_space_reserve(&_kernel, pages);
+}
+
+// maps count frames from the frame allocator, in order, at consecutive addresses
+void* vmap(void **frames, size_t count, uint64_t flags, PAGE_CACHE_TYPE cache)
+{
+    vmap_area_t *area = __alloc_area(&_kernel, count, VMAP_MAPPED);
+    if (area == NULL) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!pagetable_map_range(g_pml4, (void *)(area->start + (i * PAGE_SIZE)), (void *)virt_to_phys(frames[i]), 1, flags, cache)) {
+            vunmap((void *)area->start);
+            return NULL;
+        }
+    }
+    return (void *)area->start;
+}
+
+// virtually contiguous memory from whatever frames are free, for large buffers and stacks
+void* vmalloc(size_t size)
+{
+    size_t pages = PAGE_UP(size) / PAGE_SIZE;
+    vmap_area_t *area = __alloc_area(&_kernel, pages, VMAP_ALLOCATED);
+    if (area == NULL) return NULL;
+
+    for (size_t i = 0; i < pages; i++) {
+        void *frame = pageframe_request();
+        if (frame == NULL || !pagetable_map(g_pml4, (void *)(area->start + (i * PAGE_SIZE)), (void *)virt_to_phys(frame))) {
+            if (frame != NULL) pageframe_free(frame);
+            vunmap((void *)area->start);
+            return NULL;
+        }
+    }
+    return (void *)area->start;
+}
+
+// maps device memory, physical need not be page aligned
+void* ioremap(uint64_t physical, size_t size, PAGE_CACHE_TYPE cache)
+{
+    uint64_t offset = physical & (PAGE_SIZE - 1);
+    size_t pages = PAGE_UP(offset + size) / PAGE_SIZE;
+    vmap_area_t *area = __alloc_area(&_kernel, pages, VMAP_IOREMAP);
+    if (area == NULL) return NULL;
+
+    if (!pagetable_map_range(g_pml4, (void *)area->start, (void *)(physical - offset), pages, PAGE_KERNEL_FLAGS, cache)) {
+        vunmap((void *)area->start);
+        return NULL;
+    }
+    return (void *)(area->start + offset);
+}
+
+// takes any address inside an area, ioremap hands back ones that are not page aligned
+void vunmap(void *address)
+{
+    vmap_area_t *area = __take_area(&_kernel, (uint64_t)address);
+    if (area == NULL) return;
+
+    __unmap_area(area);
+    __release_area(&_kernel, area);
+}
+
+size_t vmap_area_count(void)
+{
+    return _kernel.busy_count;
+}
+
+static void __update_largest(rb_node_t *node)
+{
+    vmap_area_t *area = AREA(node);
+    area->largest = area->pages;
+    if (node->left != NULL && AREA(node->left)->largest > area->largest) area->largest = AREA(node->left)->largest;
+    if (node->right != NULL && AREA(node->right)->largest > area->largest) area->largest = AREA(node->right)->largest;
+}
+
+// first fit by address. the largest free range under each node steers the search, so it never has to
+// backtrack
+static vmap_area_t* __alloc_area(vmap_space_t *space, size_t pages, VMAP_TYPE type)
+{
+    if (pages == 0 || _area_cache == NULL) return NULL;
+    size_t needed = pages + VMAP_GUARD_PAGES;
+
+    vmap_area_t *area = (vmap_area_t *)kmem_cache_alloc(_area_cache);
+    if (area == NULL) return NULL;
+
+    uint64_t irq = irq_save();
+    spinlock_acquire(&space->lock);
+    rb_node_t *node = space->free.root;
+    while (node != NULL) {
+        if (node->left != NULL && AREA(node->left)->largest >= needed) node = node->left;
+        else if (AREA(node)->pages >= needed) break;
+        else if (node->right != NULL && AREA(node->right)->largest >= needed) node = node->right;
+        else node = NULL;
+    }
+
+    if (node != NULL) {
+        vmap_area_t *free = AREA(node);
+        area->start = free->start;
+        area->pages = needed;
+        area->type = type;
+
+        // shrinking a range from its start keeps the order, only the cached sizes change
+        free->start += needed * PAGE_SIZE;
+        free->pages -= needed;
+        if (free->pages == 0) {
+            rb_erase(&space->free, node);
+            kmem_cache_free(_area_cache, free);
+        } else {
+            rb_propagate(&space->free, node);
+        }
+
+        rb_node_t *parent = NULL;
+        rb_node_t **link = &space->busy.root;
+        while (*link != NULL) {
+            parent = *link;
+            link = area->start < AREA(parent)->start ? &parent->left : &parent->right;
+        }
+        rb_insert(&space->busy, &area->node, parent, link);
+        space->busy_count++;
+    }
+    spinlock_release(&space->lock);
+    irq_restore(irq);
+
+    if (node == NULL) {
+        kmem_cache_free(_area_cache, area);
+        return NULL;
+    }
+    return area;
+}
+
+static vmap_area_t* __find_area(vmap_space_t *space, uint64_t address)
+{
+    rb_node_t *node = space->busy.root;
+    while (node != NULL) {
+        vmap_area_t *area = AREA(node);
+        if (address < area->start) node = node->left;
+        else if (address >= area->start + ((area->pages - VMAP_GUARD_PAGES) * PAGE_SIZE)) node = node->right;
+        else return area;
+    }
+    return NULL;
+}
+
+// removes the in use area holding address from the busy tree, for the caller to unmap and release
+static vmap_area_t* __take_area(vmap_space_t *space, uint64_t address)
+{
+    uint64_t irq = irq_save();
+    spinlock_acquire(&space->lock);
+    vmap_area_t *area = __find_area(space, address);
+    if (area != NULL) {
+        rb_erase(&space->busy, &area->node);
+        space->busy_count--;
+    }
+    spinlock_release(&space->lock);
+    irq_restore(irq);
+    return area;
+}
+
+static void __release_area(vmap_space_t *space, vmap_area_t *area)
+{
+    uint64_t irq = irq_save();
+    spinlock_acquire(&space->lock);
+    __free_insert(space, area);
+    spinlock_release(&space->lock);
+    irq_restore(irq);
+}
+
+// returns a range to the free tree, merging it with the free ranges either side
+static void __free_insert(vmap_space_t *space, vmap_area_t *area)
+{
+    vmap_area_t *prev = NULL;
+    vmap_area_t *next = NULL;
+    rb_node_t *parent = NULL;
+    rb_node_t **link = &space->free.root;
+    while (*link != NULL) {
+        parent = *link;
+        if (area->start < AREA(parent)->start) {
+            next = AREA(parent);
+            link = &parent->left;
+        } else {
+            prev = AREA(parent);
+            link = &parent->right;
+        }
+    }
+
+    uint64_t end = area->start + (area->pages * PAGE_SIZE);
+    bool joins_prev = prev != NULL && prev->start + (prev->pages * PAGE_SIZE) == area->start;
+    bool joins_next = next != NULL && next->start == end;
+
+    if (joins_prev) {
+        prev->pages += area->pages;
+        if (joins_next) {
+            prev->pages += next->pages;
+            rb_erase(&space->free, &next->node);
+            kmem_cache_free(_area_cache, next);
+        }
+        rb_propagate(&space->free, &prev->node);
+        kmem_cache_free(_area_cache, area);
+    } else if (joins_next) {
+        next->start = area->start;
+        next->pages += area->pages;
+        rb_propagate(&space->free, &next->node);
+        kmem_cache_free(_area_cache, area);
+    } else {
+        rb_insert(&space->free, &area->node, parent, link);
+    }
+}
+
+// the frames behind a vmalloc area go back to the allocator, a TLB batch at a time so none is freed
+// while a stale translation to it may remain
+static void __unmap_area(vmap_area_t *area)
+{
+    uint64_t address = area->start;
+    size_t pages = area->pages - VMAP_GUARD_PAGES;
+    if (area->type == VMAP_RESERVED) return;
+
+    void *frames[TLB_BATCH_MAX];
+    while (pages > 0) {
+        size_t count = pages < TLB_BATCH_MAX ? pages : TLB_BATCH_MAX;
+        for (size_t i = 0; i < count; i++) {
+            void *physical = area->type == VMAP_ALLOCATED ? pagetable_translate(g_pml4, (void *)(address + (i * PAGE_SIZE))) : NULL;
+            frames[i] = physical != NULL ? phys_to_virt((uint64_t)physical) : NULL;
+        }
+        pagetable_unmap_range(g_pml4, (void *)address, count, NULL);
+        for (size_t i = 0; i < count; i++) {
+            if (frames[i] != NULL) pageframe_free(frames[i]);
+        }
+
+        address += count * PAGE_SIZE;
+        pages -= count;
+    }
+}